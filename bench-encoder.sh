@@ -0,0 +1,46 @@
+#!/usr/bin/bash
+# CPU / latency / quality matrix of the software encoder settings used by
+# --video-codec and --low-latency-encoder, on 10 seconds of videotestsrc.
+# Quality is the PSNR and SSIM of the decoded output against the source
+# frames, computed by ffmpeg.
+# Usage: ./bench-encoder.sh [width] [height] [framerate] [bitrate kbit/s]
+WIDTH=${1:-1280}
+HEIGHT=${2:-720}
+FPS=${3:-30}
+BITRATE=${4:-2000}
+FRAMES=$((FPS * 10))
+THREADS=$(nproc)
+KEYINT=$((FPS * 2))
+
+declare -A ENCODERS=(
+    ["h264 default"]="x264enc bitrate=$BITRATE ! video/x-h264,profile=constrained-baseline ! h264parse"
+    ["h264 low-latency"]="x264enc bitrate=$BITRATE tune=zerolatency speed-preset=ultrafast bframes=0 rc-lookahead=0 sliced-threads=true threads=$THREADS key-int-max=$KEYINT ! video/x-h264,profile=constrained-baseline ! h264parse"
+    ["vp8 default"]="vp8enc target-bitrate=$((BITRATE * 1000))"
+    ["vp8 low-latency"]="vp8enc target-bitrate=$((BITRATE * 1000)) deadline=1 cpu-used=8 lag-in-frames=0 end-usage=cbr error-resilient=default threads=$THREADS keyframe-max-dist=$KEYINT"
+)
+
+# Pattern with motion so the encoder has something to work on
+SOURCE="videotestsrc num-buffers=$FRAMES pattern=ball ! video/x-raw,format=I420,width=$WIDTH,height=$HEIGHT,framerate=$FPS/1"
+REFERENCE=$(mktemp)
+gst-launch-1.0 -q $SOURCE ! filesink location=$REFERENCE > /dev/null
+
+OUT=$(mktemp)
+printf "%-18s %10s %12s %14s %10s %8s\n" "encoder" "cpu (s)" "wall (s)" "latency (ms)" "psnr (dB)" "ssim"
+for name in "h264 default" "h264 low-latency" "vp8 default" "vp8 low-latency"; do
+    LOG=$(mktemp)
+    GST_TRACERS="latency(flags=element)" GST_DEBUG="GST_TRACER:7" GST_DEBUG_FILE=$LOG \
+        /usr/bin/time -f "%U %S %e" -o $OUT.time \
+        gst-launch-1.0 -q $SOURCE ! ${ENCODERS[$name]} ! matroskamux ! filesink location=$OUT > /dev/null
+    read USER SYS WALL < $OUT.time
+    LATENCY=$(grep -oE 'element-latency.*element=\(string\)(x264enc|vp8enc)[^,]*,.*time=\(guint64\)[0-9]+' $LOG \
+        | grep -oE 'time=\(guint64\)[0-9]+' | cut -d')' -f2 \
+        | awk '{ s += $1; n++ } END { if (n) printf "%.1f", s / n / 1000000; else print "n/a" }')
+    QUALITY=$(ffmpeg -nostats -i $OUT -f rawvideo -pix_fmt yuv420p -s ${WIDTH}x$HEIGHT -r $FPS -i $REFERENCE \
+        -lavfi "[0:v]split[a][b];[1:v]split[c][d];[a][c]psnr;[b][d]ssim" -f null - 2>&1)
+    PSNR=$(echo "$QUALITY" | grep -oE 'PSNR .*average:[0-9.inf]+' | grep -oE '[0-9.inf]+$')
+    SSIM=$(echo "$QUALITY" | grep -oE 'SSIM .*All:[0-9.]+' | grep -oE '[0-9.]+$')
+    printf "%-18s %10.2f %12s %14s %10s %8s\n" "$name" "$(echo "$USER + $SYS" | bc)" "$WALL" "$LATENCY" \
+        "${PSNR:-n/a}" "${SSIM:-n/a}"
+    rm -f $LOG
+done
+rm -f $OUT $OUT.time $REFERENCE
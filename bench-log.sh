@@ -0,0 +1,60 @@
+#!/usr/bin/bash
+# Signalling throughput with logging at debug level versus error only.
+# websocat plays the signalling server and sends a burst of messages the
+# camera logs at debug level: a command it does not know, carrying an SDP
+# sized body that gets dumped, followed by a GET_STATS whose reply shows it
+# was handled. The time from the first reply to the last is how long the
+# camera took. Logs go to a temporary file, pass /dev/ttyS0 or similar to
+# measure a slow console instead. Needs websocat.
+# Usage: ./bench-log.sh [messages] [log file]
+MESSAGES=${1:-10000}
+LOGFILE=$2
+if [ -z "$LOGFILE" ]; then
+    LOGFILE=$(mktemp)
+    TEMPLOG=$LOGFILE
+fi
+PORT=18443
+
+# Two dozen host candidates, about the size of a real offer
+SDP='v=0\r\no=- 4611731400430051336 2 IN IP4 127.0.0.1\r\ns=-\r\nt=0 0\r\nm=video 9 UDP/TLS/RTP/SAVPF 96\r\n'
+for i in $(seq 24); do
+    SDP="$SDP"'a=candidate:'$i' 1 udp 2122260223 192.168.1.'$i' 5'$(printf %04d $i)' typ host generation 0\r\n'
+done
+
+COMMANDS=$(mktemp)
+for i in $(seq $MESSAGES); do
+    echo '{"command": "BENCH_UNKNOWN", "sdp": "'"$SDP"'"}'
+    echo '{"command": "GET_STATS"}'
+done > $COMMANDS
+
+printf "%-10s %10s %14s\n" "log level" "time (s)" "messages/s"
+for level in error debug; do
+    REPLIES=$(mktemp)
+    # -n keeps the connection open once every command is written
+    websocat -n -t --oneshot ws-l:127.0.0.1:$PORT - < $COMMANDS > $REPLIES &
+    SERVER=$!
+    sleep 0.5
+
+    ./omniroom-camera --local-id bench --server-address 127.0.0.1 --server-port $PORT \
+        --input-stream "videotestsrc is-live=true ! x264enc" --log-level $level >> $LOGFILE 2>&1 &
+    CAMERA=$!
+
+    # Startup is the same at every level, time from the first reply on
+    while [ $(grep -c stats $REPLIES) -lt 1 ] && kill -0 $CAMERA 2> /dev/null; do
+        sleep 0.01
+    done
+    START=$(date +%s.%N)
+    while [ $(grep -c stats $REPLIES) -lt $MESSAGES ] && kill -0 $CAMERA 2> /dev/null; do
+        sleep 0.01
+    done
+    END=$(date +%s.%N)
+    COUNT=$(grep -c stats $REPLIES)
+
+    kill $CAMERA $SERVER 2> /dev/null
+    wait $CAMERA $SERVER 2> /dev/null
+    TIME=$(echo "$END - $START" | bc)
+    # Each reply stands for two messages, the logged one and GET_STATS
+    printf "%-10s %10.2f %14.0f\n" "$level" "$TIME" "$(echo "2 * ($COUNT - 1) / $TIME" | bc -l)"
+    rm -f $REPLIES
+done
+rm -f $COMMANDS $TEMPLOG
@@ -0,0 +1,46 @@
+#!/usr/bin/bash
+# Packets/s, CPU and send syscalls per packet of a running camera, to be run
+# once with 1, 5, 10 and 20 viewers connected. Packets and CPU are sampled in
+# a first pass with nothing attached to the camera. Syscalls are counted in a
+# second pass under strace, whose ptrace overhead would skew the first one.
+# Packets are counted per process with perf, ss has no UDP packet counters.
+# Needs perf, and strace for the syscall column.
+# Usage: ./bench-send.sh <camera pid> [seconds]
+PID=$1
+DURATION=${2:-10}
+TICKS=$(getconf CLK_TCK)
+
+if [ -z "$PID" ] || [ ! -d /proc/$PID ]; then
+    echo "Usage: $0 <camera pid> [seconds]" >&2
+    exit 1
+fi
+if ! command -v perf > /dev/null; then
+    echo "perf is needed to count the camera's packets" >&2
+    exit 1
+fi
+
+cpu() { awk '{ print $14 + $15 }' /proc/$PID/stat; }
+# Every packet the camera's threads hand to a network device, loopback included
+packets() {
+    perf stat -x, -e net:net_dev_queue -p $PID -- sleep $DURATION 2>&1 > /dev/null \
+        | awk -F, '$3 == "net:net_dev_queue" { print $1 + 0 }'
+}
+
+CPU0=$(cpu)
+PACKETS=$(packets)
+CPU1=$(cpu)
+PPS=$((PACKETS / DURATION))
+CPU=$(echo "scale=1; ($CPU1 - $CPU0) * 100 / $TICKS / $DURATION" | bc)
+
+CALLS=0
+if command -v strace > /dev/null; then
+    SYSCALLS=$(mktemp)
+    timeout -s INT $DURATION strace -f -c -e trace=sendmsg,sendmmsg,sendto -p $PID -o $SYSCALLS 2> /dev/null
+    CALLS=$(awk '$NF ~ /^send/ { n += $4 } END { print n + 0 }' $SYSCALLS)
+    rm -f $SYSCALLS
+fi
+
+# Both passes see the same viewers, so rates can be compared across them
+printf "%12s %10s %20s\n" "packets/s" "cpu (%)" "syscalls/packet"
+printf "%12s %10s %20s\n" "$PPS" "$CPU" \
+    "$(if [ $PACKETS -gt 0 ] && [ $CALLS -gt 0 ]; then echo "scale=2; $CALLS / $PACKETS" | bc; else echo n/a; fi)"
@@ -4,6 +4,9 @@
 #include <gst/sdp/sdp.h>
 #define GST_USE_UNSTABLE_API
 #include <gst/webrtc/webrtc.h>
+#include <gst/rtp/rtp.h>
+#include <nice/agent.h>
+#include <glib-unix.h>
 
 /* For signalling */
 #include <libsoup/soup.h>
@@ -15,11 +18,33 @@
 #include <map>
 #include <regex>
 #include <exception>
+#include <algorithm>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <sstream>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <ifaddrs.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "json.hpp"
 
-using std::cout;
-using std::endl;
 using std::string;
 using std::vector;
 using std::map;
@@ -50,7 +75,14 @@ enum AppState {
 
 static GMainLoop *loop;
 static GstElement *pipeline;
-static vector<string> peers;
+
+/* A viewer of one camera, its webrtcbin lives in that camera's pipeline */
+struct Peer {
+    string camera;
+    string id;
+    gint64 created = 0; /* monotonic time of its webrtcbin, for time-to-connected */
+};
+static vector<Peer> peers;
 
 typedef void (*callback)(json data);
 static map<string, callback> commandsMapping;
@@ -60,7 +92,93 @@ static string server_address = "127.0.0.1";
 static int server_port = 8000;
 static string input_stream = "videotestsrc ! x264enc";
 static string payload_stream = "rtph264pay ! application/x-rtp,media=video,encoding-name=H264,payload=96";
-
+static const string vp8_payload_stream = "rtpvp8pay ! application/x-rtp,media=video,encoding-name=VP8,payload=96";
+
+/* RTP packet size of every payloader, see configure_payloaders() */
+static guint rtp_mtu = 0; /* 0 keeps the payloader default */
+static bool rtp_mtu_auto = false; /* lower it to the path MTU of each viewer */
+static const guint rtp_default_mtu = 1400;
+static const int rtp_mtu_overhead = 50; /* SRTP tag, header extensions, RTX/RED and TURN framing */
+
+/* Relay mode: forward the stream of another camera instead of capturing */
+static string relay_source;
+static std::atomic<bool> relay_audio{false}; /* the camera sends audio too */
+
+/* ICE gathering of each webrtcbin, see configure_ice() */
+static string stun_server;
+static string turn_server;
+static bool ice_host_only = false; /* LAN deployments: no srflx or relay candidates */
+static bool ice_udp_only = false;
+static vector<string> ice_interfaces; /* empty for all of them */
+static int ice_family = AF_UNSPEC;
+static vector<string> ice_addresses; /* local addresses candidates are gathered on */
+static guint ice_min_port = 0; /* UDP ports shared by all peers, 0 for random ones */
+static guint ice_max_port = 0;
+
+/* Extra cameras served by this process, id to input stream, see camera_pipeline() */
+static map<string, string> extra_cameras;
+static map<string, GstElement*> camera_pipelines; /* includes local_id */
+static std::deque<string> joining_cameras; /* sent JOIN_CAMERA, waiting for JOINED_CAMERA */
+
+/* Loss protection of the video sent to each peer, see configure_loss_protection() */
+static int rtx_time = 0; /* milliseconds of packets kept for retransmission, 0 disables NACK/RTX */
+static int fec_percentage = 0; /* minimum ULPFEC overhead, 0 disables FEC */
+static int fec_max_percentage = 50;
+
+/* Per peer leaky bucket at this multiple of the stream bitrate, 0 disables it */
+static double pacing_factor = 0;
+
+/* Per peer frame dropping under congestion, see onPeerPacket() */
+static bool drop_frames = false;
+
+/* Optional audio source, encoded once and shared by all peers */
+static string audio_stream;
+
+/* Capture backend auto-selection, see probe_input_stream() */
+static bool auto_input = false;
+static string video_device;
+static int video_width = 1280;
+static int video_height = 720;
+static int video_framerate = 30;
+static int video_bitrate = 2000; /* kbit/s */
+static string video_codec = "h264";
+static bool low_latency_encoder = false;
+static bool intra_refresh = false;
+static std::atomic<bool> idr_pending{false}; /* a viewer joined since the last IDR, see onKeyUnitRequest() */
+
+/* Local recording of the encoded stream, see recording_branch() */
+static string record_dir;
+static string record_format = "mp4";
+static int record_segment = 60; /* seconds */
+static int record_retention = 3600; /* seconds */
+
+/* Low resolution rendition for grid views, see thumbnail_branch() */
+static bool thumbnail = false;
+static const int thumbnail_width = 320;
+static const int thumbnail_height = 180;
+static const int thumbnail_framerate = 5;
+static const int thumbnail_bitrate = 150; /* kbit/s */
+
+/* Motion detection on raw frames, see motion_branch() */
+static bool motion = false;
+static int motion_threshold = 10; /* mean absolute difference per pixel, 0-255 */
+
+/* Scene activity estimated from encoded frame sizes, see onEncodedFrame() */
+static bool activity = false;
+static double activity_threshold = 1.5; /* short term over long term frame size */
+
+/* Pre-roll ring of encoded frames flushed to a clip on SAVE_CLIP */
+static int preroll_seconds = 0;
+static int preroll_max_mb = 64;
+static string clip_dir = ".";
+
+/* JPEG snapshots of the latest frame, see requestSnapshot() */
+static bool snapshots = false;
+static int snapshot_port = 0;
+static string snapshot_address = "127.0.0.1";
+static int snapshot_ttl = 2000; /* milliseconds */
+
+static int keepalive_interval = 0; /* seconds, 0 leaves websocket pings off */
 static bool use_ssl = false;
 static bool use_http_auth = false;
 static string http_user;
@@ -69,9 +187,306 @@ static string http_password;
 static SoupWebsocketConnection *ws_conn = nullptr;
 static enum AppState app_state = APP_STATE_UNKNOWN;
 
+/* Logging: producers format their line and push it into a bounded lock-free
+ * ring (Vyukov MPMC queue, used here with a single consumer). A background
+ * thread drains it so that no caller ever blocks on a slow console or journald.
+ * When the ring is full the line is dropped and accounted for. The thread
+ * sleeps while the ring is empty, and only the line that finds it asleep
+ * takes the lock to wake it. */
+enum LogLevel {
+    LOG_ERROR = 0,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_DEBUG,
+};
+
+static const char* log_level_names[] = {"error", "warning", "info", "debug"};
+static LogLevel log_level = LOG_INFO;
+
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    LogLevel level;
+    string text;
+};
+
+static const size_t log_ring_size = 4096; /* must be a power of two */
+static LogSlot log_ring[log_ring_size];
+static std::atomic<size_t> log_enqueue_pos{0};
+static size_t log_dequeue_pos = 0; /* only touched by the consumer */
+static std::atomic<size_t> log_dropped{0};
+static std::atomic<bool> log_running{false};
+static std::atomic<bool> log_waiting{false}; /* drain thread asleep on log_wakeup */
+static std::mutex log_mutex;
+static std::condition_variable log_wakeup;
+static std::thread log_thread;
+
+static void log_enqueue(LogLevel level, string text) {
+    LogSlot* slot;
+    size_t pos = log_enqueue_pos.load(std::memory_order_relaxed);
+
+    for (;;) {
+        slot = &log_ring[pos & (log_ring_size - 1)];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (log_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            log_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = log_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->text = std::move(text);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (log_waiting.exchange(false)) {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        log_wakeup.notify_one();
+    }
+}
+
+static bool log_pending() {
+    return log_ring[log_dequeue_pos & (log_ring_size - 1)].sequence.load(std::memory_order_acquire) == log_dequeue_pos + 1;
+}
+
+static bool log_dequeue(LogLevel& level, string& text) {
+    if (!log_pending())
+        return false;
+
+    LogSlot& slot = log_ring[log_dequeue_pos & (log_ring_size - 1)];
+    level = slot.level;
+    text = std::move(slot.text);
+    slot.text.clear();
+    slot.sequence.store(log_dequeue_pos + log_ring_size, std::memory_order_release);
+    log_dequeue_pos++;
+    return true;
+}
+
+static void log_drain() {
+    LogLevel level;
+    string text;
+    bool wrote = false;
+
+    while (log_dequeue(level, text)) {
+        FILE* out = level <= LOG_WARNING ? stderr : stdout;
+        fprintf(out, "[%s] %s\n", log_level_names[level], text.c_str());
+        wrote = true;
+    }
+
+    size_t dropped = log_dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped)
+        fprintf(stderr, "[warning] %zu log messages dropped\n", dropped);
+
+    if (wrote || dropped) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+}
+
+static void log_start() {
+    for (size_t i = 0; i < log_ring_size; i++)
+        log_ring[i].sequence.store(i, std::memory_order_relaxed);
+
+    log_running = true;
+    log_thread = std::thread([]() {
+        while (log_running.load(std::memory_order_acquire)) {
+            log_drain();
+
+            std::unique_lock<std::mutex> lock(log_mutex);
+            log_waiting = true;
+            /* A line queued before log_waiting was set would not wake us */
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (log_pending()) {
+                log_waiting = false;
+                continue;
+            }
+            log_wakeup.wait(lock, []() { return !log_waiting || !log_running; });
+        }
+        log_drain();
+    });
+}
+
+static void log_stop() {
+    if (!log_running.exchange(false))
+        return;
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        log_wakeup.notify_one();
+    }
+    log_thread.join();
+}
+
+/* One log line, queued when the statement ends */
+class LogLine {
+public:
+    explicit LogLine(LogLevel level) : level(level) {}
+    ~LogLine() { log_enqueue(level, stream.str()); }
+
+    template<typename T>
+    LogLine& operator<<(const T& value) {
+        stream << value;
+        return *this;
+    }
+
+private:
+    LogLevel level;
+    std::ostringstream stream;
+};
+
+/* Turns the whole streaming expression into void for the conditional below */
+struct LogVoidify {
+    void operator&(LogLine&) {}
+};
+
+/* Arguments are not even formatted when the level is disabled */
+#define LOG(level) !((level) <= log_level) ? (void) 0 : LogVoidify() & LogLine(level)
+
+/* Profiling: events are collected in memory and dumped as a Chrome trace
+ * (chrome://tracing, ui.perfetto.dev) when the main loop exits. */
+struct TraceEvent {
+    string name;
+    string category;
+    gint64 ts; /* microseconds, monotonic clock */
+    gint64 dur; /* microseconds */
+    guint32 tid;
+};
+
+static string trace_file;
+static const size_t trace_max_events = 100000; /* about 10 MB */
+static size_t trace_dropped = 0;
+static std::mutex trace_mutex;
+static vector<TraceEvent> trace_events;
+
+static void trace_record(const string& name, const string& category, gint64 ts, gint64 dur) {
+    if (trace_file.empty())
+        return;
+
+    guint32 tid = static_cast<guint32>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    if (trace_events.size() < trace_max_events)
+        trace_events.push_back({name, category, ts, dur, tid});
+    else
+        trace_dropped++;
+}
+
+/* Times the enclosing scope, used on our own signalling/negotiation callbacks */
+class ScopedTrace {
+public:
+    explicit ScopedTrace(const char* name) : name(name), start(g_get_monotonic_time()) {}
+    ~ScopedTrace() { trace_record(name, "callback", start, g_get_monotonic_time() - start); }
+
+private:
+    const char* name;
+    gint64 start;
+};
+
+/* Tracer timestamps count from gst_init, ours are monotonic. A record is
+ * logged in the thread that emitted it right after its ts was taken, so the
+ * first one gives the offset between the two clocks. */
+static std::atomic<gint64> tracer_origin{0};
+
+/* Receives the records emitted by the latency and proctime tracers, every
+ * other debug message goes to the default handler. */
+static void onGstLog(GstDebugCategory* category, GstDebugLevel level, const gchar* file, const gchar* function,
+        gint line, GObject* object, GstDebugMessage* message, gpointer user_data G_GNUC_UNUSED) {
+    if (g_strcmp0(gst_debug_category_get_name(category), "GST_TRACER") != 0) {
+        gst_debug_log_default(category, level, file, function, line, object, message, nullptr);
+        return;
+    }
+
+    GstStructure* record = gst_structure_from_string(gst_debug_message_get(message), nullptr);
+    if (!record)
+        return;
+
+    string record_name = gst_structure_get_name(record);
+    string name;
+    if (record_name == "latency") {
+        const gchar* src = gst_structure_get_string(record, "src-element");
+        const gchar* sink = gst_structure_get_string(record, "sink-element");
+        name = string(src ? src : "?") + " -> " + (sink ? sink : "?");
+    } else if (record_name == "element-latency" || record_name == "proctime") {
+        const gchar* element = gst_structure_get_string(record, "element");
+        name = element ? element : "?";
+    }
+
+    guint64 time = 0, ts = 0;
+    if (!name.empty() && gst_structure_get_uint64(record, "time", &time)) {
+        /* ts is when the record was emitted, i.e. the end of the measured span */
+        gint64 end = g_get_monotonic_time();
+        if (gst_structure_get_uint64(record, "ts", &ts)) {
+            gint64 origin = 0;
+            if (!tracer_origin.compare_exchange_strong(origin, end - static_cast<gint64>(ts / 1000)))
+                end = origin + static_cast<gint64>(ts / 1000);
+        }
+        gint64 dur = static_cast<gint64>(time / 1000);
+        trace_record(name, record_name, end - dur, dur);
+    }
+    gst_structure_free(record);
+}
+
+static void start_tracing() {
+    /* proctime comes from gst-shark, core only has latency */
+    GstPluginFeature* proctime = gst_registry_lookup_feature(gst_registry_get(), "proctime");
+    if (proctime)
+        gst_object_unref(proctime);
+    else
+        LOG(LOG_WARNING) << "proctime tracer not found, install gst-shark for per-element processing times";
+
+    gst_debug_set_active(true);
+    gst_debug_set_threshold_for_name("GST_TRACER", GST_LEVEL_TRACE);
+    gst_debug_remove_log_function(gst_debug_log_default);
+    gst_debug_add_log_function(onGstLog, nullptr, nullptr);
+    LOG(LOG_INFO) << "Profiling enabled, trace will be written to " << trace_file;
+}
+
+static void write_trace_file() {
+    if (trace_file.empty())
+        return;
+
+    json events = json::array();
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        for (auto& ev : trace_events) {
+            events.push_back({{"name", ev.name}, {"cat", ev.category}, {"ph", "X"},
+                {"ts", ev.ts}, {"dur", ev.dur}, {"pid", 1}, {"tid", ev.tid}});
+        }
+    }
+
+    std::ofstream out(trace_file);
+    out << json{{"traceEvents", events}, {"displayTimeUnit", "ms"}}.dump();
+    LOG(LOG_INFO) << "Wrote " << events.size() << " trace events to " << trace_file;
+    if (trace_dropped)
+        LOG(LOG_WARNING) << "Trace full, " << trace_dropped << " later events were not recorded";
+}
+
+
+/* Startup breakdown: each phase lasts from the previous mark to its own,
+ * logged once the camera is registered and its pipeline runs. */
+static gint64 startup_begin = 0;
+static gint64 startup_last = 0;
+static std::ostringstream startup_phases;
+static std::atomic<gint64> certificate_time{0}; /* microseconds, generated in the background */
+
+static void startup_mark(const char* phase) {
+    gint64 now = g_get_monotonic_time();
+    trace_record(phase, "startup", startup_last, now - startup_last);
+    startup_phases << phase << " " << (now - startup_last) / 1000 << " ms, ";
+    startup_last = now;
+}
+
+static void log_startup() {
+    LOG(LOG_INFO) << "Startup: " << startup_phases.str() << "total " << (startup_last - startup_begin) / 1000
+        << " ms (certificate " << certificate_time.load() / 1000 << " ms in background)";
+}
+
 static bool cleanup_and_quit_loop(string msg, enum AppState state) {
     if (!msg.empty())
-        cout << msg << endl;
+        LOG(state == APP_STATE_UNKNOWN ? LOG_INFO : LOG_ERROR) << msg;
 
     if (state > 0)
         app_state = state;
@@ -94,13 +509,20 @@ static bool cleanup_and_quit_loop(string msg, enum AppState state) {
 }
 
 
-static void sendICECandidate(GstElement* webrtc G_GNUC_UNUSED, guint mlineindex, gchar* candidate, gpointer peer_id) {
+/* Pipeline of a camera served by this process, nullptr for unknown ids */
+static GstElement* camera_pipeline(const string& camera) {
+    auto found = camera_pipelines.find(camera);
+    return found != camera_pipelines.end() ? found->second : nullptr;
+}
+
+
+static void sendICECandidate(GstElement* webrtc G_GNUC_UNUSED, guint mlineindex, gchar* candidate, gpointer user_data) {
     if (app_state < ROOM_CALL_OFFERING) {
         cleanup_and_quit_loop("Can't send ICE, not in call", APP_STATE_ERROR);
         return;
     }
 
-    std::string* identifier = static_cast<std::string*>(peer_id);
+    Peer* peer = static_cast<Peer*>(user_data);
 
     json ice;
     ice["candidate"] = candidate;
@@ -108,21 +530,24 @@ static void sendICECandidate(GstElement* webrtc G_GNUC_UNUSED, guint mlineindex,
 
     json sdp;
     sdp["command"] = "ICE_CANDIDATE";
-    sdp["identifier"] = peers.back();
+    sdp["identifier"] = peer->id;
+    sdp["camera"] = peer->camera;
     sdp["ice"] = ice;
     soup_websocket_connection_send_text(ws_conn, sdp.dump().c_str());
 }
 
 
-static void sendSDPOffer(GstWebRTCSessionDescription* desc, string peer_id) {
+static void sendSDPOffer(GstWebRTCSessionDescription* desc, const Peer& peer) {
     g_assert_cmpint(app_state, >=, ROOM_CALL_OFFERING);
 
     string text = gst_sdp_message_as_text(desc->sdp);
-    cout << "Sending sdp offer to " << peer_id << endl << text << endl;
+    LOG(LOG_INFO) << "Sending sdp offer of " << peer.camera << " to " << peer.id;
+    LOG(LOG_DEBUG) << "Offer:\n" << text;
 
     json sdp;
     sdp["command"] = "SDP_OFFER";
-    sdp["identifier"] = peer_id;
+    sdp["identifier"] = peer.id;
+    sdp["camera"] = peer.camera;
     sdp["offer"]["type"] = "offer";
     sdp["offer"]["sdp"] = text;
     soup_websocket_connection_send_text(ws_conn, sdp.dump().c_str());
@@ -130,14 +555,15 @@ static void sendSDPOffer(GstWebRTCSessionDescription* desc, string peer_id) {
 
 
 /* Offer created by our pipeline, to be sent to the peer */
-static void onOfferCreated(GstPromise* promise, gpointer peer_id) {
+static void onOfferCreated(GstPromise* promise, gpointer user_data) {
     GstElement *webrtc;
     GstWebRTCSessionDescription *offer;
     const GstStructure *reply;
 
-    std::string* identifier = static_cast<std::string*>(peer_id);
+    ScopedTrace trace("onOfferCreated");
+    Peer* peer = static_cast<Peer*>(user_data);
 
-    cout << "Offer created" << endl;
+    LOG(LOG_DEBUG) << "Offer created";
 
     g_assert_cmpint(app_state, ==, ROOM_CALL_OFFERING);
 
@@ -147,182 +573,2141 @@ static void onOfferCreated(GstPromise* promise, gpointer peer_id) {
     gst_promise_unref(promise);
 
     promise = gst_promise_new();
-    webrtc = gst_bin_get_by_name(GST_BIN(pipeline), identifier->c_str());
+    webrtc = gst_bin_get_by_name(GST_BIN(camera_pipeline(peer->camera)), peer->id.c_str());
     g_assert_nonnull(webrtc);
     g_signal_emit_by_name(webrtc, "set-local-description", offer, promise);
     gst_promise_interrupt(promise);
     gst_promise_unref(promise);
 
     /* Send offer to peer */
-    sendSDPOffer(offer, *identifier);
+    sendSDPOffer(offer, *peer);
     gst_webrtc_session_description_free(offer);
 }
 
 
-static void onNegotiationNeeded(GstElement* webrtc, gpointer peer_id) {
+static void onNegotiationNeeded(GstElement* webrtc, gpointer user_data) {
     GstPromise *promise;
 
-    std::string* identifier = static_cast<std::string*>(peer_id);
-
-    cout << "Negotiation needed" << endl;
+    LOG(LOG_DEBUG) << "Negotiation needed";
 
     app_state = ROOM_CALL_OFFERING;
-    promise = gst_promise_new_with_change_func((GstPromiseChangeFunc) onOfferCreated, peer_id, nullptr);
+    promise = gst_promise_new_with_change_func((GstPromiseChangeFunc) onOfferCreated, user_data, nullptr);
     g_signal_emit_by_name(webrtc, "create-offer", nullptr, promise);
 }
 
 
-static void remove_peer_from_pipeline(string peer_id) {
-    gchar *qname;
-    GstPad *srcpad, *sinkpad;
-    GstElement *webrtc, *q, *tee;
+/*
+ * Software encoder for a codec, the configured one by default. The low-latency
+ * profile removes lookahead and B-frames, picks the fastest preset, spreads
+ * each frame over all cores and bounds the GOP to two seconds.
+ */
+static string software_encoder(bool low_latency, int bitrate = video_bitrate, int framerate = video_framerate,
+        const string& codec = video_codec) {
+    string threads = std::to_string(std::max(1u, std::thread::hardware_concurrency()));
+    string keyint = std::to_string(framerate * 2);
+
+    if (codec == "vp8" || codec == "vp9") {
+        string encoder = codec + "enc target-bitrate=" + std::to_string(bitrate * 1000);
+        if (low_latency)
+            encoder += " deadline=1 cpu-used=8 lag-in-frames=0 end-usage=cbr error-resilient=default threads=" + threads
+                + " keyframe-max-dist=" + keyint;
+        /* Two temporal layers: every other frame references the last base
+         * frame and updates nothing, so the frame dropper can discard it */
+        if (codec == "vp8" && drop_frames)
+            encoder += " temporal-scalability-number-layers=2 temporal-scalability-periodicity=2"
+                " temporal-scalability-layer-id=\"<0,1>\" temporal-scalability-rate-decimator=\"<2,1>\""
+                " temporal-scalability-target-bitrate=\"<" + std::to_string(bitrate * 600) + ","
+                + std::to_string(bitrate * 1000) + ">\""
+                " temporal-scalability-layer-flags=\"<no-ref-golden+no-upd-golden+no-upd-alt,"
+                "no-ref-golden+no-upd-last+no-upd-golden+no-upd-alt+no-upd-entropy>\"";
+        return encoder;
+    }
 
-    webrtc = gst_bin_get_by_name(GST_BIN(pipeline), peer_id.c_str());
-    if (!webrtc)
-        return;
+    if (codec == "av1") {
+        string encoder = "av1enc target-bitrate=" + std::to_string(bitrate);
+        if (low_latency)
+            encoder += " usage-profile=realtime cpu-used=10 lag-in-frames=0 end-usage=cbr threads=" + threads
+                + " keyframe-max-dist=" + keyint;
+        return encoder;
+    }
 
-    gst_bin_remove(GST_BIN(pipeline), webrtc);
-    gst_object_unref(webrtc);
+    string encoder = "x264enc bitrate=" + std::to_string(bitrate);
+    if (low_latency)
+        encoder += " tune=zerolatency speed-preset=ultrafast bframes=0 rc-lookahead=0 sliced-threads=true threads=" + threads;
+    /* No intra refresh here: x264enc answers a forced key unit with a new
+     * wave, never an IDR, and a browser only starts decoding on an IDR */
+    if (low_latency)
+        encoder += " key-int-max=" + keyint;
+    return encoder + " ! video/x-h264,profile=constrained-baseline";
+}
 
-    qname = g_strdup_printf("queue-%s", peer_id);
-    q = gst_bin_get_by_name(GST_BIN(pipeline), qname);
-    g_free(qname);
 
-    sinkpad = gst_element_get_static_pad(q, "sink");
-    g_assert_nonnull(sinkpad);
-    srcpad = gst_pad_get_peer(sinkpad);
-    g_assert_nonnull(srcpad);
-    gst_object_unref(sinkpad);
+/* RTP payloader matching software_encoder() output */
+static string payloader_for(const string& codec) {
+    if (codec == "vp8")
+        return vp8_payload_stream;
+    if (codec == "vp9")
+        return "rtpvp9pay ! application/x-rtp,media=video,encoding-name=VP9,payload=96";
+    if (codec == "av1")
+        return "rtpav1pay ! application/x-rtp,media=video,encoding-name=AV1,payload=96";
+    return "rtph264pay config-interval=-1 ! application/x-rtp,media=video,encoding-name=H264,payload=96";
+}
 
-    gst_bin_remove(GST_BIN(pipeline), q);
-    gst_object_unref(q);
 
-    tee = gst_bin_get_by_name(GST_BIN(pipeline), "videotee");
-    g_assert_nonnull(tee);
-    gst_element_release_request_pad(tee, srcpad);
-    gst_object_unref(srcpad);
-    gst_object_unref(tee);
+/*
+ * Packets larger than the path MTU get fragmented by IP, and losing either
+ * fragment loses the packet. Payloaders split frames at rtp_mtu. For H.264,
+ * zero-latency aggregation bundles SPS, PPS and SEI with the slice that
+ * follows them in one STAP-A instead of sending three tiny packets.
+ */
+static void configure_payloaders(GstElement* bin) {
+    GstIterator* it = gst_bin_iterate_recurse(GST_BIN(bin));
+    GValue item = G_VALUE_INIT;
+    while (gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+        GstElement* element = GST_ELEMENT(g_value_get_object(&item));
+        GstElementFactory* factory = gst_element_get_factory(element);
+        string name = factory ? GST_OBJECT_NAME(factory) : "";
+        if (name.size() > 6 && name.compare(0, 3, "rtp") == 0 && name.compare(name.size() - 3, 3, "pay") == 0) {
+            if (rtp_mtu)
+                g_object_set(element, "mtu", rtp_mtu, nullptr);
+            if (g_object_class_find_property(G_OBJECT_GET_CLASS(element), "aggregate-mode"))
+                gst_util_set_object_arg(G_OBJECT(element), "aggregate-mode", "zero-latency");
+        }
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(it);
+}
+
+/* RTP packet size that fits the kernel's path MTU towards a remote ICE
+ * candidate, 0 when unknown. Connecting a UDP socket sends nothing, it only
+ * looks up the route and any MTU learnt from ICMP for that destination. */
+static guint path_rtp_mtu(const string& candidate) {
+    /* candidate:<foundation> <component> <transport> <priority> <address> <port> typ ... */
+    std::istringstream fields(candidate);
+    string foundation, component, transport, priority, address, port;
+    fields >> foundation >> component >> transport >> priority >> address >> port;
+    if (g_ascii_strcasecmp(transport.c_str(), "udp") != 0)
+        return 0;
+
+    /* mDNS .local names are not resolved here */
+    struct addrinfo hints = {};
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    struct addrinfo* info;
+    if (getaddrinfo(address.c_str(), port.c_str(), &hints, &info) != 0)
+        return 0;
+
+    int mtu = 0;
+    bool ipv6 = info->ai_family == AF_INET6;
+    int fd = socket(info->ai_family, SOCK_DGRAM, 0);
+    if (fd >= 0 && connect(fd, info->ai_addr, info->ai_addrlen) == 0) {
+        socklen_t length = sizeof(mtu);
+        if (getsockopt(fd, ipv6 ? IPPROTO_IPV6 : IPPROTO_IP, ipv6 ? IPV6_MTU : IP_MTU, &mtu, &length) != 0)
+            mtu = 0;
+    }
+    if (fd >= 0)
+        close(fd);
+    freeaddrinfo(info);
+
+    mtu -= (ipv6 ? 40 : 20) + 8 + rtp_mtu_overhead;
+    return mtu > 0 ? mtu : 0;
+}
+
+
+static bool has_element(const string& name) {
+    GstElementFactory* factory = gst_element_factory_find(name.c_str());
+    if (!factory)
+        return false;
+    gst_object_unref(factory);
+    return true;
+}
+
+
+/*
+ * Codec renditions: the main one is input_stream itself and feeds videotee.
+ * Peers whose browser prefers another codec get a rendition encoded from the
+ * raw frames, started with its first peer, shared by every peer using that
+ * codec and torn down with its last one.
+ */
+struct Rendition {
+    GstElement* bin;
+    GstElement* tee;
+    GstPad* source_pad; /* request pad on rawtee or encodedtee */
+    int peers;
+};
+
+static map<string, Rendition> renditions;
+static map<string, string> peer_codecs;
+static const vector<string> supported_codecs = {"h264", "vp8", "vp9", "av1"};
+
+static string rendition_tee(const string& codec) {
+    return codec == video_codec ? "videotee" : "videotee-" + codec;
+}
+
+static bool can_encode(const string& codec) {
+    if (codec == video_codec)
+        return true;
+    /* A relay only has the camera's RTP, nothing to encode from */
+    if (!relay_source.empty())
+        return false;
+    if (codec == "h264")
+        return has_element("x264enc") && has_element("rtph264pay");
+    return has_element(codec + "enc") && has_element("rtp" + codec + "pay");
 }
 
+/* First codec of the peer's preference list we can produce. Entries are codec
+ * names or mime types, as in RTCRtpReceiver.getCapabilities("video"). */
+static string choose_codec(const json& codecs) {
+    if (!codecs.is_array())
+        return video_codec;
 
-static void add_peer_to_pipeline(string peer_id, gboolean offer) {
+    for (auto& entry : codecs) {
+        if (!entry.is_string())
+            continue;
+        string name = entry.get<string>();
+        if (name.rfind("video/", 0) == 0)
+            name = name.substr(6);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (std::find(supported_codecs.begin(), supported_codecs.end(), name) != supported_codecs.end() && can_encode(name))
+            return name;
+    }
+    return video_codec;
+}
+
+static bool start_rendition(const string& codec) {
     int ret;
-    GstElement *tee, *webrtc, *q;
-    GstPad *srcpad, *sinkpad;
+    GError* error = nullptr;
+    bool raw = input_stream.find("name=rawtee") != string::npos;
 
-    string name = "queue-" + peer_id;
-    q = gst_element_factory_make("queue", name.c_str());
-    g_assert_nonnull(q);
-    cout << "Created webrtcbin: " << peer_id << endl;
-    webrtc = gst_element_factory_make("webrtcbin", peer_id.c_str());
-    g_assert_nonnull(webrtc);
+    string description = string("queue leaky=downstream max-size-buffers=2") + (raw ? "" : " ! decodebin")
+        + " ! videoconvert ! " + software_encoder(true, video_bitrate, video_framerate, codec)
+        + " ! " + payloader_for(codec) + " ! queue";
+    GstElement* bin = gst_parse_bin_from_description(description.c_str(), true, &error);
+    if (error) {
+        LOG(LOG_ERROR) << "Failed to create " << codec << " rendition: " << error->message;
+        g_error_free(error);
+        if (bin)
+            gst_object_unref(bin);
+        return false;
+    }
+    configure_payloaders(bin);
 
-    g_assert_nonnull(pipeline);
-    gst_bin_add_many(GST_BIN(pipeline), q, webrtc, nullptr);
+    GstElement* tee = gst_element_factory_make("tee", rendition_tee(codec).c_str());
+    g_assert_nonnull(tee);
+    g_object_set(tee, "allow-not-linked", true, nullptr);
+    gst_bin_add_many(GST_BIN(pipeline), bin, tee, nullptr);
+    ret = gst_element_link(bin, tee);
+    g_assert_true(ret);
+    ret = gst_element_sync_state_with_parent(tee);
+    g_assert_true(ret);
+    ret = gst_element_sync_state_with_parent(bin);
+    g_assert_true(ret);
 
-    srcpad = gst_element_get_static_pad(q, "src");
+    /* Only feed it once it is running */
+    GstElement* source = gst_bin_get_by_name(GST_BIN(pipeline), raw ? "rawtee" : "encodedtee");
+    g_assert_nonnull(source);
+    GstPad* srcpad = gst_element_get_request_pad(source, "src_%u");
     g_assert_nonnull(srcpad);
-    sinkpad = gst_element_get_request_pad(webrtc, "sink_%u");
+    gst_object_unref(source);
+    GstPad* sinkpad = gst_element_get_static_pad(bin, "sink");
     g_assert_nonnull(sinkpad);
     ret = gst_pad_link(srcpad, sinkpad);
     g_assert_cmpint(ret, ==, GST_PAD_LINK_OK);
-    gst_object_unref(srcpad);
     gst_object_unref(sinkpad);
 
-    tee = gst_bin_get_by_name(GST_BIN(pipeline), "videotee");
-    g_assert_nonnull(tee);
-    srcpad = gst_element_get_request_pad(tee, "src_%u");
-    g_assert_nonnull(srcpad);
-    gst_object_unref(tee);
-    sinkpad = gst_element_get_static_pad(q, "sink");
-    g_assert_nonnull(sinkpad);
-    ret = gst_pad_link(srcpad, sinkpad);
-    g_assert_cmpint(ret, ==, GST_PAD_LINK_OK);
+    renditions[codec] = {bin, tee, srcpad, 0};
+    LOG(LOG_INFO) << "Started " << codec << " rendition";
+    return true;
+}
+
+static void stop_rendition(const string& codec) {
+    auto it = renditions.find(codec);
+    if (it == renditions.end())
+        return;
+    Rendition rendition = it->second;
+    renditions.erase(it);
+
+    GstElement* source = gst_pad_get_parent_element(rendition.source_pad);
+    GstPad* sinkpad = gst_pad_get_peer(rendition.source_pad);
+    if (sinkpad) {
+        gst_pad_unlink(rendition.source_pad, sinkpad);
+        gst_object_unref(sinkpad);
+    }
+    gst_element_release_request_pad(source, rendition.source_pad);
+    gst_object_unref(rendition.source_pad);
+    gst_object_unref(source);
+
+    gst_element_set_state(rendition.bin, GST_STATE_NULL);
+    gst_element_set_state(rendition.tee, GST_STATE_NULL);
+    gst_bin_remove_many(GST_BIN(pipeline), rendition.bin, rendition.tee, nullptr);
+    LOG(LOG_INFO) << "Stopped " << codec << " rendition";
+}
+
+
+/*
+ * Loss protection: NACK with RTX retransmits from a buffer covering rtx_time,
+ * ULP FEC with RED adds redundancy. The FEC overhead follows the loss each
+ * viewer reports in RTCP, between fec_percentage and fec_max_percentage, so
+ * clean links pay almost nothing.
+ */
+static void onDeepElementAdded(GstBin* bin G_GNUC_UNUSED, GstBin* sub_bin G_GNUC_UNUSED, GstElement* element, gpointer user_data G_GNUC_UNUSED) {
+    GstElementFactory* factory = gst_element_get_factory(element);
+    if (factory && g_strcmp0(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), "rtprtxsend") == 0)
+        g_object_set(element, "max-size-time", static_cast<guint>(rtx_time), "max-size-packets", 0u, nullptr);
+}
+
+static void configure_loss_protection(GstElement* webrtc) {
+    if (!rtx_time && !fec_percentage)
+        return;
+
+    /* The video transceiver is the first one, see link_peer_queue() */
+    GstWebRTCRTPTransceiver* transceiver = nullptr;
+    g_signal_emit_by_name(webrtc, "get-transceiver", 0, &transceiver);
+    g_assert_nonnull(transceiver);
+    if (rtx_time) {
+        g_object_set(transceiver, "do-nack", true, nullptr);
+        g_signal_connect(webrtc, "deep-element-added", G_CALLBACK(onDeepElementAdded), nullptr);
+    }
+    if (fec_percentage)
+        g_object_set(transceiver, "fec-type", GST_WEBRTC_FEC_TYPE_ULP_RED, "fec-percentage", static_cast<guint>(fec_percentage), nullptr);
+    gst_object_unref(transceiver);
+}
+
+static gboolean adaptFecStat(GQuark field_id G_GNUC_UNUSED, const GValue* value, gpointer user_data) {
+    double* loss = static_cast<double*>(user_data);
+    if (!GST_VALUE_HOLDS_STRUCTURE(value))
+        return true;
+
+    const GstStructure* stat = gst_value_get_structure(value);
+    double fraction_lost;
+    if (gst_structure_has_name(stat, "remote-inbound-rtp") && gst_structure_get_double(stat, "fraction-lost", &fraction_lost))
+        *loss = std::max(*loss, fraction_lost);
+    return true;
+}
+
+static void update_loss_level(const Peer& peer, double loss);
+
+static void onPeerStats(GstPromise* promise, gpointer user_data) {
+    Peer* peer = static_cast<Peer*>(user_data);
+    double loss = 0.0;
+
+    if (gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED)
+        gst_structure_foreach(gst_promise_get_reply(promise), adaptFecStat, &loss);
+    gst_promise_unref(promise);
+    if (drop_frames)
+        update_loss_level(*peer, loss);
+    if (!fec_percentage) {
+        delete peer;
+        return;
+    }
+
+    /* Twice the loss rate in redundancy recovers most single losses */
+    guint percentage = std::min(fec_max_percentage, std::max(fec_percentage, static_cast<int>(loss * 200)));
+    GstElement* bin = camera_pipeline(peer->camera);
+    GstElement* webrtc = bin ? gst_bin_get_by_name(GST_BIN(bin), peer->id.c_str()) : nullptr;
+    if (webrtc) {
+        GstWebRTCRTPTransceiver* transceiver = nullptr;
+        g_signal_emit_by_name(webrtc, "get-transceiver", 0, &transceiver);
+        if (transceiver) {
+            g_object_set(transceiver, "fec-percentage", percentage, nullptr);
+            gst_object_unref(transceiver);
+        }
+        gst_object_unref(webrtc);
+    }
+    LOG(LOG_DEBUG) << "Peer " << peer->id << " of " << peer->camera << " loss " << loss << ", FEC " << percentage << "%";
+    delete peer;
+}
+
+/* Loss reported by each viewer drives FEC and frame dropping */
+static gboolean pollPeerStats(gpointer user_data G_GNUC_UNUSED) {
+    if (!pipeline)
+        return G_SOURCE_CONTINUE;
+
+    for (auto& peer : peers) {
+        GstElement* webrtc = gst_bin_get_by_name(GST_BIN(camera_pipeline(peer.camera)), peer.id.c_str());
+        if (!webrtc)
+            continue;
+        GstPromise* promise = gst_promise_new_with_change_func(onPeerStats, new Peer(peer), nullptr);
+        g_signal_emit_by_name(webrtc, "get-stats", nullptr, promise);
+        gst_object_unref(webrtc);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+
+/*
+ * Without pacing, every keyframe leaves each peer's queue at line rate, and
+ * with N peers the switch sees N bursts at once. The pacer sleeps in the
+ * queue's streaming thread so packets go out at pacing_factor times the
+ * stream bitrate, measured on the way into the queue since --bitrate does not
+ * describe a custom --input-stream. A few milliseconds of credit let small
+ * frames through without waiting. The pacer never owes more than
+ * pacer_max_wait: past that it lets the backlog out unpaced, so a queue can
+ * not fill up and block the tee for every other peer.
+ */
+struct Pacer {
+    std::atomic<gint64> rate; /* kbit/s, moving average of the incoming stream */
+    gint64 window_start = 0; /* rate measurement, streaming thread of the tee */
+    gint64 window_bytes = 0;
+    gint64 next = 0; /* earliest send time of the next packet */
+    std::mutex mutex; /* arrivals and delay figures, the latter read by GET_STATS */
+    std::deque<gint64> arrivals; /* of the queued packets, in queue order */
+    gint64 delay_total = 0; /* from entering the queue to leaving it */
+    gint64 delay_max = 0;
+    gint64 packets = 0;
+};
+static const gint64 pacer_burst = 5000; /* microseconds */
+static const gint64 pacer_max_wait = 200000; /* microseconds */
+static const gint64 pacer_window = 500000; /* microseconds */
+static map<string, std::shared_ptr<Pacer>> pacers; /* camera/peer id */
+
+/* Payloaders push a list per frame, pacing and frame dropping work packet by packet */
+static GstPadProbeReturn onSplitList(GstPad* pad, GstPadProbeInfo* info, gpointer user_data G_GNUC_UNUSED) {
+    GstBufferList* list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    for (guint i = 0; i < gst_buffer_list_length(list); i++)
+        gst_pad_chain(pad, gst_buffer_ref(gst_buffer_list_get(list, i)));
+    return GST_PAD_PROBE_DROP;
+}
+
+static GstPadProbeReturn onPacerInput(GstPad* pad G_GNUC_UNUSED, GstPadProbeInfo* info, gpointer user_data) {
+    Pacer* pacer = static_cast<std::shared_ptr<Pacer>*>(user_data)->get();
+    if (info->type & GST_PAD_PROBE_TYPE_EVENT_FLUSH) {
+        if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_FLUSH_STOP) {
+            std::lock_guard<std::mutex> lock(pacer->mutex);
+            pacer->arrivals.clear();
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    {
+        std::lock_guard<std::mutex> lock(pacer->mutex);
+        pacer->arrivals.push_back(now);
+    }
+    if (!pacer->window_start)
+        pacer->window_start = now;
+    pacer->window_bytes += gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+
+    gint64 elapsed = now - pacer->window_start;
+    if (elapsed >= pacer_window) {
+        gint64 measured = pacer->window_bytes * 8000 / elapsed;
+        pacer->rate = std::max<gint64>(1, (pacer->rate * 3 + measured) / 4);
+        pacer->window_start = now;
+        pacer->window_bytes = 0;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn onPacedPacket(GstPad* pad G_GNUC_UNUSED, GstPadProbeInfo* info, gpointer user_data) {
+    Pacer* pacer = static_cast<std::shared_ptr<Pacer>*>(user_data)->get();
+    gsize size = gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+
+    gint64 now = g_get_monotonic_time();
+    pacer->next = std::max(pacer->next, now - pacer_burst);
+    gint64 wait = pacer->next - now;
+    if (wait > pacer_max_wait) {
+        /* Falling behind the stream, catch up rather than grow the queue */
+        pacer->next = now;
+        wait = 0;
+    }
+    if (wait > 0)
+        g_usleep(wait);
+    gint64 rate = std::max<gint64>(1, static_cast<gint64>(pacer->rate * pacing_factor));
+    pacer->next += static_cast<gint64>(size) * 8000 / rate;
+
+    /* The whole time in the queue: a packet late in a burst also waited for
+     * every packet paced before it */
+    std::lock_guard<std::mutex> lock(pacer->mutex);
+    gint64 delay = 0;
+    if (!pacer->arrivals.empty()) {
+        delay = std::max<gint64>(0, g_get_monotonic_time() - pacer->arrivals.front());
+        pacer->arrivals.pop_front();
+    }
+    pacer->delay_total += delay;
+    pacer->delay_max = std::max(pacer->delay_max, delay);
+    pacer->packets++;
+    return GST_PAD_PROBE_OK;
+}
+
+static void deletePacer(gpointer user_data) {
+    delete static_cast<std::shared_ptr<Pacer>*>(user_data);
+}
+
+/* bitrate is only the starting point until the first window is measured */
+static void install_pacer(const Peer& peer, GstElement* q, int bitrate) {
+    auto pacer = std::make_shared<Pacer>();
+    pacer->rate = std::max(1, bitrate);
+    pacers[peer.camera + "/" + peer.id] = pacer;
+
+    /* Queued packets are limited by time only, a keyframe is many packets */
+    g_object_set(q, "max-size-buffers", 0u, nullptr);
+
+    GstPad* sinkpad = gst_element_get_static_pad(q, "sink");
+    gst_pad_add_probe(sinkpad, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_FLUSH),
+        onPacerInput, new std::shared_ptr<Pacer>(pacer), deletePacer);
+    gst_object_unref(sinkpad);
+    GstPad* srcpad = gst_element_get_static_pad(q, "src");
+    gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER, onPacedPacket, new std::shared_ptr<Pacer>(pacer), deletePacer);
     gst_object_unref(srcpad);
+}
+
+/* Average and worst pacing delay of each peer since the previous call */
+static json pacer_stats(const string& camera) {
+    json stats = json::object();
+    for (auto& pacer : pacers) {
+        if (pacer.first.compare(0, camera.size() + 1, camera + "/") != 0)
+            continue;
+        std::lock_guard<std::mutex> lock(pacer.second->mutex);
+        json& peer = stats[pacer.first.substr(camera.size() + 1)];
+        peer["delay_ms"] = pacer.second->packets ? pacer.second->delay_total / pacer.second->packets / 1000.0 : 0.0;
+        peer["max_delay_ms"] = pacer.second->delay_max / 1000.0;
+        peer["rate_kbps"] = pacer.second->rate.load();
+        pacer.second->delay_total = pacer.second->delay_max = pacer.second->packets = 0;
+    }
+    return stats;
+}
+
+
+static void split_buffer_lists(GstElement* q) {
+    GstPad* sinkpad = gst_element_get_static_pad(q, "sink");
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER_LIST, onSplitList, nullptr, nullptr);
+    gst_object_unref(sinkpad);
+}
+
+
+/*
+ * A congested viewer should get fewer frames rather than late ones. Frames
+ * are dropped before the peer's queue, so it stays short and other viewers
+ * are unaffected. The congestion level comes from the loss the viewer
+ * reports and from the backlog in its queue:
+ *  1: drop non-reference frames, they are free to lose
+ *  2: drop the rest of the GOP, until the next keyframe
+ * Only the software VP8 encoder produces non-reference frames, through its
+ * temporal layers. Constrained-baseline H.264 references every P slice, so
+ * with H.264 level 1 drops nothing and only level 2 applies.
+ * Once level 2 is over a key unit is requested so the viewer does not wait a
+ * whole GOP. Sequence numbers are shifted over dropped packets, a gap would
+ * otherwise be NACKed and then PLIed by the receiver.
+ */
+enum FrameKind {
+    FRAME_NONE, /* no decision possible from this packet */
+    FRAME_KEY,
+    FRAME_DELTA,
+    FRAME_DISPOSABLE,
+};
+
+struct FrameDropper {
+    string codec;
+    GstElement* queue; /* not a reference, the probe goes away with it */
+    std::atomic<int> loss_level{0};
+    bool decided = false; /* frame in progress has a verdict */
+    bool dropping = false;
+    bool gop_dropping = false;
+    bool key_requested = false;
+    guint16 seq_offset = 0;
+    std::atomic<gint64> dropped{0};
+};
+static std::mutex droppers_mutex; /* stats are polled from webrtcbin threads */
+static map<string, std::shared_ptr<FrameDropper>> droppers; /* camera/peer id */
+
+/* AUD, SEI and parameter sets only are FRAME_NONE, the verdict waits for a slice */
+static FrameKind h264_frame_kind(const guint8* payload, guint size) {
+    if (size < 2)
+        return FRAME_NONE;
+    guint8 type = payload[0] & 0x1f;
+    guint8 nri = payload[0] & 0x60;
+    if (type == 28) {
+        if (!(payload[1] & 0x80)) /* FU-A continuation */
+            return FRAME_NONE;
+        type = payload[1] & 0x1f;
+    }
+    if (type == 24) {
+        FrameKind kind = FRAME_NONE;
+        for (guint offset = 1; offset + 2 < size;) {
+            guint length = payload[offset] << 8 | payload[offset + 1];
+            FrameKind nal = h264_frame_kind(payload + offset + 2, std::min(length, size - offset - 2));
+            if (nal == FRAME_KEY || (nal == FRAME_DELTA && kind != FRAME_KEY) || kind == FRAME_NONE)
+                kind = nal;
+            offset += 2 + length;
+        }
+        return kind;
+    }
+    if (type == 5 || type == 7)
+        return FRAME_KEY;
+    if (type >= 1 && type <= 4)
+        return nri ? FRAME_DELTA : FRAME_DISPOSABLE;
+    return FRAME_NONE;
+}
+
+/* RFC 7741 payload descriptor, then the VP8 frame tag on the first packet */
+static FrameKind vp8_frame_kind(const guint8* payload, guint size) {
+    if (size < 1 || !(payload[0] & 0x10) || (payload[0] & 0x07))
+        return FRAME_NONE;
+    guint offset = 1;
+    if (payload[0] & 0x80) {
+        if (size < 2)
+            return FRAME_NONE;
+        guint8 extension = payload[1];
+        offset = 2;
+        if (extension & 0x80)
+            offset += (size > offset && (payload[offset] & 0x80)) ? 2 : 1;
+        if (extension & 0x40)
+            offset++;
+        if (extension & 0x30)
+            offset++;
+    }
+    if (offset >= size)
+        return FRAME_NONE;
+    if (!(payload[offset] & 0x01))
+        return FRAME_KEY;
+    return (payload[0] & 0x20) ? FRAME_DISPOSABLE : FRAME_DELTA;
+}
+
+static int queue_level(GstElement* q) {
+    guint64 level = 0;
+    g_object_get(q, "current-level-time", &level, nullptr);
+    return level > 250 * GST_MSECOND ? 2 : level > 100 * GST_MSECOND ? 1 : 0;
+}
+
+static void update_loss_level(const Peer& peer, double loss) {
+    std::lock_guard<std::mutex> lock(droppers_mutex);
+    auto dropper = droppers.find(peer.camera + "/" + peer.id);
+    if (dropper != droppers.end())
+        dropper->second->loss_level = loss >= 0.10 ? 2 : loss >= 0.03 ? 1 : 0;
+}
+
+static GstPadProbeReturn onPeerPacket(GstPad* pad, GstPadProbeInfo* info, gpointer user_data) {
+    FrameDropper* dropper = static_cast<std::shared_ptr<FrameDropper>*>(user_data)->get();
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+        return GST_PAD_PROBE_OK;
+
+    if (!dropper->decided) {
+        const guint8* payload = static_cast<const guint8*>(gst_rtp_buffer_get_payload(&rtp));
+        guint size = gst_rtp_buffer_get_payload_len(&rtp);
+        FrameKind kind = dropper->codec == "h264" ? h264_frame_kind(payload, size)
+            : dropper->codec == "vp8" ? vp8_frame_kind(payload, size) : FRAME_NONE;
+        if (kind != FRAME_NONE) {
+            int level = std::max(dropper->loss_level.load(), queue_level(dropper->queue));
+            if (kind == FRAME_KEY) {
+                dropper->gop_dropping = dropper->key_requested = false;
+            } else if (level >= 2) {
+                dropper->gop_dropping = true;
+            } else if (dropper->gop_dropping && !dropper->key_requested) {
+                /* Intra refresh never sends a keyframe, the wave repairs the decoder */
+                GstStructure* request = gst_structure_new("GstForceKeyUnit", "running-time", G_TYPE_UINT64, GST_CLOCK_TIME_NONE,
+                    "all-headers", G_TYPE_BOOLEAN, TRUE, "count", G_TYPE_UINT, 0, nullptr);
+                gst_pad_push_event(pad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, request));
+                dropper->key_requested = true;
+                dropper->gop_dropping = !intra_refresh;
+            }
+            dropper->dropping = dropper->gop_dropping || (level >= 1 && kind == FRAME_DISPOSABLE);
+            dropper->decided = true;
+            if (dropper->dropping)
+                dropper->dropped++;
+        }
+    }
+
+    bool dropping = dropper->decided && dropper->dropping;
+    if (gst_rtp_buffer_get_marker(&rtp))
+        dropper->decided = false;
+    gst_rtp_buffer_unmap(&rtp);
+
+    if (dropping) {
+        dropper->seq_offset++;
+        return GST_PAD_PROBE_DROP;
+    }
+    if (dropper->seq_offset) {
+        /* Shared with the other peers, copied before rewriting */
+        buffer = gst_buffer_make_writable(buffer);
+        if (gst_rtp_buffer_map(buffer, GST_MAP_WRITE, &rtp)) {
+            gst_rtp_buffer_set_seq(&rtp, gst_rtp_buffer_get_seq(&rtp) - dropper->seq_offset);
+            gst_rtp_buffer_unmap(&rtp);
+        }
+        GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void deleteDropper(gpointer user_data) {
+    delete static_cast<std::shared_ptr<FrameDropper>*>(user_data);
+}
+
+static void install_frame_dropper(const Peer& peer, GstElement* q, const string& codec) {
+    auto dropper = std::make_shared<FrameDropper>();
+    dropper->codec = codec;
+    dropper->queue = q;
+    {
+        std::lock_guard<std::mutex> lock(droppers_mutex);
+        droppers[peer.camera + "/" + peer.id] = dropper;
+    }
+
+    GstPad* sinkpad = gst_element_get_static_pad(q, "sink");
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, onPeerPacket, new std::shared_ptr<FrameDropper>(dropper), deleteDropper);
     gst_object_unref(sinkpad);
+}
+
+/* Frames dropped for each peer of a camera since it joined */
+static json dropper_stats(const string& camera) {
+    json stats = json::object();
+    std::lock_guard<std::mutex> lock(droppers_mutex);
+    for (auto& dropper : droppers) {
+        if (dropper.first.compare(0, camera.size() + 1, camera + "/") == 0)
+            stats[dropper.first.substr(camera.size() + 1)] = dropper.second->dropped.load();
+    }
+    return stats;
+}
+
+
+/* Unlinks and removes the queue feeding a peer from its tee */
+static void unlink_peer_queue(GstElement* bin, const string& queue_name) {
+    GstPad *srcpad, *sinkpad;
+    GstElement *q, *tee;
+
+    q = gst_bin_get_by_name(GST_BIN(bin), queue_name.c_str());
+    if (!q)
+        return;
+
+    sinkpad = gst_element_get_static_pad(q, "sink");
+    g_assert_nonnull(sinkpad);
+    srcpad = gst_pad_get_peer(sinkpad);
+    g_assert_nonnull(srcpad);
+
+    /* Peers can be fed by videotee, a codec rendition, thumbtee or audiotee */
+    tee = gst_pad_get_parent_element(srcpad);
+    g_assert_nonnull(tee);
+
+    gst_pad_unlink(srcpad, sinkpad);
+    gst_element_release_request_pad(tee, srcpad);
+    gst_object_unref(sinkpad);
+
+    gst_element_set_state(q, GST_STATE_NULL);
+    gst_bin_remove(GST_BIN(bin), q);
+    gst_object_unref(q);
+
+    gst_object_unref(srcpad);
+    gst_object_unref(tee);
+}
+
+
+static void remove_peer_from_pipeline(const Peer& peer) {
+    GstElement *bin, *webrtc;
+
+    bin = camera_pipeline(peer.camera);
+    webrtc = bin ? gst_bin_get_by_name(GST_BIN(bin), peer.id.c_str()) : nullptr;
+    if (!webrtc)
+        return;
+
+    LOG(LOG_INFO) << "Removing peer " << peer.id << " of " << peer.camera;
+    unlink_peer_queue(bin, "queue-" + peer.id);
+    unlink_peer_queue(bin, "audioqueue-" + peer.id);
+
+    gst_element_set_state(webrtc, GST_STATE_NULL);
+    gst_bin_remove(GST_BIN(bin), webrtc);
+    gst_object_unref(webrtc);
+
+    /* Only the primary camera has codec renditions */
+    auto codec = peer.camera == local_id ? peer_codecs.find(peer.id) : peer_codecs.end();
+    if (codec != peer_codecs.end()) {
+        auto rendition = renditions.find(codec->second);
+        if (rendition != renditions.end() && --rendition->second.peers == 0)
+            stop_rendition(codec->second);
+        peer_codecs.erase(codec);
+    }
+    pacers.erase(peer.camera + "/" + peer.id);
+    {
+        std::lock_guard<std::mutex> lock(droppers_mutex);
+        droppers.erase(peer.camera + "/" + peer.id);
+    }
+    peers.erase(std::remove_if(peers.begin(), peers.end(), [&peer](const Peer& other) {
+        return other.camera == peer.camera && other.id == peer.id;
+    }), peers.end());
+}
+
+
+static gboolean removePeerLater(gpointer user_data) {
+    Peer* peer = static_cast<Peer*>(user_data);
+    remove_peer_from_pipeline(*peer);
+    delete peer;
+    return G_SOURCE_REMOVE;
+}
+
+
+static void onIceConnectionStateChanged(GstElement* webrtc, GParamSpec* pspec G_GNUC_UNUSED, gpointer user_data) {
+    GstWebRTCICEConnectionState state;
+    g_object_get(webrtc, "ice-connection-state", &state, nullptr);
+    Peer* peer = static_cast<Peer*>(user_data);
+    if (state == GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED) {
+        gint64 now = g_get_monotonic_time();
+        trace_record("ice-connected", "ice", peer->created, now - peer->created);
+        LOG(LOG_INFO) << "ICE connected with " << peer->id << " in " << (now - peer->created) / 1000 << " ms";
+        return;
+    }
+    if (state != GST_WEBRTC_ICE_CONNECTION_STATE_FAILED && state != GST_WEBRTC_ICE_CONNECTION_STATE_CLOSED)
+        return;
+
+    /* Notified from a webrtcbin thread, tear down from the main loop */
+    LOG(LOG_WARNING) << "ICE connection with " << peer->id << " of " << peer->camera << " lost";
+    g_idle_add(removePeerLater, new Peer(*peer));
+}
+
+
+/* Each signal handler owns a copy of the peer, freed with the webrtcbin */
+static void deletePeer(gpointer user_data, GClosure* closure G_GNUC_UNUSED) {
+    delete static_cast<Peer*>(user_data);
+}
+
+
+/* Adds a queue between a tee and a new sink pad of the peer's webrtcbin */
+static GstElement* link_peer_queue(GstElement* bin, GstElement* webrtc, const string& tee_name, const string& queue_name) {
+    int ret;
+    GstElement *tee, *q;
+    GstPad *srcpad, *sinkpad;
+
+    q = gst_element_factory_make("queue", queue_name.c_str());
+    g_assert_nonnull(q);
+    gst_bin_add(GST_BIN(bin), q);
+
+    srcpad = gst_element_get_static_pad(q, "src");
+    g_assert_nonnull(srcpad);
+    sinkpad = gst_element_get_request_pad(webrtc, "sink_%u");
+    g_assert_nonnull(sinkpad);
+    ret = gst_pad_link(srcpad, sinkpad);
+    g_assert_cmpint(ret, ==, GST_PAD_LINK_OK);
+    gst_object_unref(srcpad);
+    gst_object_unref(sinkpad);
+
+    tee = gst_bin_get_by_name(GST_BIN(bin), tee_name.c_str());
+    g_assert_nonnull(tee);
+    srcpad = gst_element_get_request_pad(tee, "src_%u");
+    g_assert_nonnull(srcpad);
+    gst_object_unref(tee);
+    sinkpad = gst_element_get_static_pad(q, "sink");
+    g_assert_nonnull(sinkpad);
+    ret = gst_pad_link(srcpad, sinkpad);
+    g_assert_cmpint(ret, ==, GST_PAD_LINK_OK);
+    gst_object_unref(srcpad);
+    gst_object_unref(sinkpad);
+
+    return q;
+}
+
+
+/* Local addresses of the allowed interfaces and family, IPv6 link-local and
+ * loopback excluded. Empty when gathering is not restricted. */
+static vector<string> ice_local_addresses() {
+    vector<string> addresses;
+    if (ice_interfaces.empty() && ice_family == AF_UNSPEC)
+        return addresses;
+
+    struct ifaddrs* interfaces;
+    if (getifaddrs(&interfaces) != 0)
+        return addresses;
+    for (struct ifaddrs* ifa = interfaces; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || (ifa->ifa_flags & IFF_LOOPBACK) || !(ifa->ifa_flags & IFF_UP))
+            continue;
+        int family = ifa->ifa_addr->sa_family;
+        if (family != AF_INET && family != AF_INET6)
+            continue;
+        if (ice_family != AF_UNSPEC && family != ice_family)
+            continue;
+        if (!ice_interfaces.empty() && std::find(ice_interfaces.begin(), ice_interfaces.end(), ifa->ifa_name) == ice_interfaces.end())
+            continue;
+        if (family == AF_INET6 && IN6_IS_ADDR_LINKLOCAL(&reinterpret_cast<struct sockaddr_in6*>(ifa->ifa_addr)->sin6_addr))
+            continue;
+
+        char host[NI_MAXHOST];
+        socklen_t length = family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        if (getnameinfo(ifa->ifa_addr, length, host, sizeof(host), nullptr, 0, NI_NUMERICHOST) == 0)
+            addresses.push_back(host);
+    }
+    freeifaddrs(interfaces);
+    return addresses;
+}
+
+/*
+ * Every candidate is one more pair to check with each viewer. Docker bridges,
+ * VPN tunnels and unused families are left out by pinning the agent to the
+ * allowed addresses. This must happen before set-local-description starts
+ * gathering. libnice cannot switch to ICE-lite after creation, so the closest
+ * we get is a short candidate list.
+ */
+static void configure_ice(GstElement* webrtc) {
+    if (!ice_host_only) {
+        if (!stun_server.empty())
+            g_object_set(webrtc, "stun-server", stun_server.c_str(), nullptr);
+        if (!turn_server.empty())
+            g_object_set(webrtc, "turn-server", turn_server.c_str(), nullptr);
+    }
+
+    /* Audio and video share one transport, one socket per peer and address */
+    g_object_set(webrtc, "bundle-policy", GST_WEBRTC_BUNDLE_POLICY_MAX_BUNDLE, nullptr);
+
+    GObject* ice = nullptr;
+    NiceAgent* agent = nullptr;
+    g_object_get(webrtc, "ice-agent", &ice, nullptr);
+    g_assert_nonnull(ice);
+
+    /* Each agent binds the first free port of the range */
+    if (ice_min_port)
+        g_object_set(ice, "min-rtp-port", ice_min_port, "max-rtp-port", ice_max_port, nullptr);
+    if (ice_addresses.empty() && !ice_udp_only) {
+        g_object_unref(ice);
+        return;
+    }
+
+    g_object_get(ice, "agent", &agent, nullptr);
+    g_assert_nonnull(agent);
+
+    for (auto& address : ice_addresses) {
+        NiceAddress local;
+        if (nice_address_set_from_string(&local, address.c_str()))
+            nice_agent_add_local_address(agent, &local);
+    }
+    if (ice_udp_only)
+        g_object_set(agent, "ice-tcp", false, nullptr);
+
+    g_object_unref(agent);
+    g_object_unref(ice);
+}
+
+
+static void add_peer_to_pipeline(Peer peer, gboolean offer, const string& tee_name = "videotee") {
+    int ret;
+    GstElement *bin, *webrtc, *q, *audio_q = nullptr;
+    ScopedTrace trace("add_peer_to_pipeline");
+
+    LOG(LOG_INFO) << "Created webrtcbin: " << peer.id << " for " << peer.camera;
+    peer.created = g_get_monotonic_time();
+    if (ice_min_port && peers.size() > ice_max_port - ice_min_port)
+        LOG(LOG_WARNING) << "More peers than ICE ports " << ice_min_port << "-" << ice_max_port << ", " << peer.id << " may not connect";
+    webrtc = gst_element_factory_make("webrtcbin", peer.id.c_str());
+    g_assert_nonnull(webrtc);
+    configure_ice(webrtc);
+
+    bin = camera_pipeline(peer.camera);
+    g_assert_nonnull(bin);
+    gst_bin_add(GST_BIN(bin), webrtc);
+
+    q = link_peer_queue(bin, webrtc, tee_name, "queue-" + peer.id);
+    if (tee_name == "videotee" && bin == pipeline)
+        idr_pending = true;
+    if (pacing_factor > 0 || drop_frames)
+        split_buffer_lists(q);
+    if (drop_frames) {
+        auto codec = bin == pipeline ? peer_codecs.find(peer.id) : peer_codecs.end();
+        install_frame_dropper(peer, q, codec != peer_codecs.end() && tee_name != "thumbtee" ? codec->second : video_codec);
+    }
+    if (pacing_factor > 0)
+        install_pacer(peer, q, tee_name == "thumbtee" ? thumbnail_bitrate : video_bitrate);
+    /* Thumbnail peers are grid tiles, they do not get audio. The microphone
+     * belongs to the primary camera. */
+    if ((!audio_stream.empty() || relay_audio) && tee_name != "thumbtee" && bin == pipeline)
+        audio_q = link_peer_queue(bin, webrtc, "audiotee", "audioqueue-" + peer.id);
+    configure_loss_protection(webrtc);
+
+    /* This is the gstwebrtc entry point where we create the offer and so on. It
+     * will be called when the pipeline goes to PLAYING.
+     * XXX: We must connect this after webrtcbin has been linked to a source via
+     * get_request_pad() and before we go from NULL->READY otherwise webrtcbin
+     * will create an SDP offer with no media lines in it. */
+    peers.push_back(peer);
+    if (offer) {
+        LOG(LOG_DEBUG) << "Offer";
+        g_signal_connect_data(webrtc, "on-negotiation-needed", G_CALLBACK(onNegotiationNeeded), new Peer(peer),
+            deletePeer, static_cast<GConnectFlags>(0));
+    } else {
+        LOG(LOG_DEBUG) << "No offer";
+    }
+
+    /* We need to transmit this ICE candidate to the browser via the websockets
+     * signalling server. Incoming ice candidates from the browser need to be
+     * added by us too, see on_server_message() */
+    g_signal_connect_data(webrtc, "on-ice-candidate", G_CALLBACK(sendICECandidate), new Peer(peer),
+        deletePeer, static_cast<GConnectFlags>(0));
+    g_signal_connect_data(webrtc, "notify::ice-connection-state", G_CALLBACK(onIceConnectionStateChanged), new Peer(peer),
+        deletePeer, static_cast<GConnectFlags>(0));
+
+    /* Set to pipeline branch to PLAYING */
+    ret = gst_element_sync_state_with_parent(q);
+    g_assert_true(ret);
+    if (audio_q) {
+        ret = gst_element_sync_state_with_parent(audio_q);
+        g_assert_true(ret);
+    }
+    ret = gst_element_sync_state_with_parent(webrtc);
+    g_assert_true(ret);
+}
+
+
+static void callPeer(json data) {
+    Peer peer{data.value("camera", local_id), data["identifier"].get<string>()};
+    if (!camera_pipeline(peer.camera)) {
+        LOG(LOG_WARNING) << "CALL for " << peer.camera << " before it joined";
+        return;
+    }
+    LOG(LOG_INFO) << "Calling peer... " << peer.id;
+
+    /* Extra cameras only have their main stream */
+    if (peer.camera != local_id) {
+        add_peer_to_pipeline(peer, true);
+        return;
+    }
+    if (thumbnail && data.value("mode", "") == "thumbnail") {
+        add_peer_to_pipeline(peer, true, "thumbtee");
+        return;
+    }
+
+    string codec = choose_codec(data.value("codecs", json()));
+    if (codec != video_codec && renditions.find(codec) == renditions.end() && !start_rendition(codec))
+        codec = video_codec;
+    if (codec != video_codec)
+        renditions[codec].peers++;
+    peer_codecs[peer.id] = codec;
+
+    LOG(LOG_INFO) << "Sending " << codec << " to " << peer.id;
+    add_peer_to_pipeline(peer, true, rendition_tee(codec));
+}
+
+
+static void hangUp(json data) {
+    remove_peer_from_pipeline(Peer{data.value("camera", local_id), data["identifier"].get<string>()});
+}
+
+/*
+ * Writes the already encoded stream to fixed-duration segments. splitmuxsink
+ * deletes the oldest segment once max-files is reached, which gives the
+ * retention ring. MP4 segments are fragmented so nothing is rewritten when a
+ * segment is closed. The leaky queue keeps a slow disk from stalling peers.
+ */
+static string recording_branch() {
+    if (record_dir.empty())
+        return "";
+
+    string muxer = record_format == "ts" ? "mpegtsmux"
+        : "mp4mux muxer-properties=\"properties,fragment-duration=1000\"";
+    string extension = record_format == "ts" ? "ts" : "mp4";
+    int files = std::max(1, record_retention / record_segment);
+
+    return " encodedtee. ! queue leaky=downstream max-size-buffers=0 max-size-bytes=0 max-size-time=" + std::to_string(2 * GST_SECOND)
+        + " ! h264parse ! splitmuxsink name=recorder location=" + record_dir + "/segment-%05d." + extension
+        + " muxer-factory=" + muxer + " max-size-time=" + std::to_string(record_segment * GST_SECOND)
+        + " max-files=" + std::to_string(files) + " send-keyframe-requests=true";
+}
+
+
+/* Start of a side branch working on raw frames, leaky so it never slows peers */
+static string raw_source_branch() {
+    if (input_stream.find("name=rawtee") != string::npos)
+        return "rawtee. ! queue leaky=downstream max-size-buffers=2";
+    return "encodedtee. ! queue leaky=downstream max-size-buffers=2 ! decodebin";
+}
+
+
+/*
+ * Second, tiny rendition served to peers that CALL with mode "thumbnail". It is
+ * scaled from the raw frames when input_stream exposes a rawtee, otherwise the
+ * main stream has to be decoded first. videorate drops frames before scaling
+ * so the extra encoder only ever sees thumbnail_framerate.
+ */
+static string thumbnail_branch() {
+    if (!thumbnail)
+        return "";
+
+    string payloader = payloader_for(video_codec);
+
+    return " " + raw_source_branch() + " ! videorate drop-only=true ! video/x-raw,framerate=" + std::to_string(thumbnail_framerate) + "/1"
+        + " ! videoscale ! videoconvert ! video/x-raw,width=" + std::to_string(thumbnail_width)
+        + ",height=" + std::to_string(thumbnail_height)
+        + " ! " + software_encoder(true, thumbnail_bitrate, thumbnail_framerate)
+        + " ! " + payloader + " ! queue ! tee name=thumbtee ! queue ! fakesink";
+}
+
+
+/*
+ * Audio is encoded once, whatever the number of peers. 10 ms Opus frames keep
+ * the packetization delay low and each peer gets its own queue off audiotee.
+ */
+static string audio_branch() {
+    if (audio_stream.empty())
+        return "";
+
+    return " " + audio_stream + " ! audioconvert ! audioresample ! opusenc frame-size=10 audio-type=voice bitrate=32000"
+        " ! rtpopuspay ! application/x-rtp,media=audio,encoding-name=OPUS,payload=97"
+        " ! queue ! tee name=audiotee ! queue ! fakesink";
+}
+
+
+/*
+ * Motion detection: luma is scaled down to a small GRAY8 frame at a few fps and
+ * compared with the previous one. The grid of regions gets one score each, the
+ * mean absolute difference of its pixels. Regions are 64 pixels wide so rows
+ * split evenly into SIMD registers.
+ */
+static const int motion_width = 256;
+static const int motion_height = 144;
+static const int motion_framerate = 5;
+static const int motion_grid = 4;
+static const int motion_region_width = motion_width / motion_grid;
+static const int motion_region_height = motion_height / motion_grid;
+
+static string motion_branch() {
+    if (!motion)
+        return "";
+
+    return " " + raw_source_branch() + " ! videorate drop-only=true ! video/x-raw,framerate=" + std::to_string(motion_framerate) + "/1"
+        + " ! videoscale ! videoconvert ! video/x-raw,format=GRAY8,width=" + std::to_string(motion_width)
+        + ",height=" + std::to_string(motion_height) + " ! fakesink name=motionsink sync=false";
+}
+
+/* Sum of absolute differences of one row of a region */
+static guint32 sad_row(const guint8* a, const guint8* b, int width) {
+    guint32 sum = 0;
+    int x = 0;
+
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; x + 32 <= width; x += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + x));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + x));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum += _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    sum += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(__ARM_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; x + 16 <= width; x += 16)
+        acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x))));
+    sum += vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+    for (; x < width; x++)
+        sum += a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+    return sum;
+}
+
+/* Sends a message queued from a streaming thread, as a GSourceFunc */
+static gboolean sendEvent(gpointer user_data) {
+    string* text = static_cast<string*>(user_data);
+    if (ws_conn && soup_websocket_connection_get_state(ws_conn) == SOUP_WEBSOCKET_STATE_OPEN)
+        soup_websocket_connection_send_text(ws_conn, text->c_str());
+    delete text;
+    return G_SOURCE_REMOVE;
+}
+
+static GstPadProbeReturn onMotionFrame(GstPad* pad G_GNUC_UNUSED, GstPadProbeInfo* info, gpointer user_data G_GNUC_UNUSED) {
+    /* Only ever called from motionsink's streaming thread */
+    static vector<guint8> previous;
+    static bool active = false;
+    static gint64 last_event = 0;
+
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return GST_PAD_PROBE_OK;
+
+    /* GRAY8 rows are 4 byte aligned, motion_width already is */
+    if (map.size < static_cast<gsize>(motion_width * motion_height) || previous.empty()) {
+        previous.assign(map.data, map.data + std::min(map.size, static_cast<gsize>(motion_width * motion_height)));
+        gst_buffer_unmap(buffer, &map);
+        return GST_PAD_PROBE_OK;
+    }
+
+    json regions = json::array();
+    int max_score = 0;
+    for (int gy = 0; gy < motion_grid; gy++) {
+        json row = json::array();
+        for (int gx = 0; gx < motion_grid; gx++) {
+            guint32 sad = 0;
+            for (int y = gy * motion_region_height; y < (gy + 1) * motion_region_height; y++) {
+                gsize offset = y * motion_width + gx * motion_region_width;
+                sad += sad_row(map.data + offset, previous.data() + offset, motion_region_width);
+            }
+            int score = sad / (motion_region_width * motion_region_height);
+            max_score = std::max(max_score, score);
+            row.push_back(score);
+        }
+        regions.push_back(row);
+    }
+    previous.assign(map.data, map.data + motion_width * motion_height);
+    gst_buffer_unmap(buffer, &map);
+
+    /* Report state changes, and at most once a second while active */
+    bool now_active = max_score >= motion_threshold;
+    gint64 now = g_get_monotonic_time();
+    if (now_active == active && (!active || now - last_event < G_USEC_PER_SEC))
+        return GST_PAD_PROBE_OK;
+    active = now_active;
+    last_event = now;
+
+    json event;
+    event["command"] = "MOTION";
+    event["identifier"] = local_id;
+    event["active"] = active;
+    event["score"] = max_score;
+    event["regions"] = regions;
+    g_idle_add(sendEvent, new string(event.dump()));
+    return GST_PAD_PROBE_OK;
+}
+
+static void install_motion_probe() {
+    GstElement* sink = gst_bin_get_by_name(GST_BIN(pipeline), "motionsink");
+    g_assert_nonnull(sink);
+    GstPad* sinkpad = gst_element_get_static_pad(sink, "sink");
+    g_assert_nonnull(sinkpad);
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, onMotionFrame, nullptr, nullptr);
+    gst_object_unref(sinkpad);
+    gst_object_unref(sink);
+}
+
+
+/*
+ * Activity hints from the encoder: with a steady scene delta frames are small,
+ * with motion they grow (or the rate control raises QP to hold them, so this
+ * works best with VBR). A fast and a slow moving average of delta frame sizes
+ * are kept and their ratio is the activity metric, at the cost of a few
+ * arithmetic operations per frame. Keyframes are skipped as they say nothing
+ * about motion. Activity ends below a lower threshold than it starts at, and
+ * events are a second apart at least, so a ratio hovering around the
+ * threshold does not send an event per frame.
+ */
+static std::atomic<double> activity_level{0.0};
+static std::atomic<bool> activity_active{false};
+static const double activity_release = 0.8; /* share of the threshold that ends activity */
+
+static GstPadProbeReturn onEncodedFrame(GstPad* pad G_GNUC_UNUSED, GstPadProbeInfo* info, gpointer user_data G_GNUC_UNUSED) {
+    /* Only ever called from the encoder's streaming thread */
+    static double fast = 0.0, slow = 0.0;
+    static gint64 last_event = 0;
+
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_OK;
+
+    double size = static_cast<double>(gst_buffer_get_size(buffer));
+    if (slow == 0.0) {
+        fast = slow = size;
+        return GST_PAD_PROBE_OK;
+    }
+    fast += 0.3 * (size - fast);
+    slow += 0.005 * (size - slow);
+
+    double level = fast / slow;
+    activity_level = level;
+
+    bool active = activity_active.load();
+    bool now_active = level >= activity_threshold * (active ? activity_release : 1.0);
+    gint64 now = g_get_monotonic_time();
+    if (now_active == active || now - last_event < G_USEC_PER_SEC)
+        return GST_PAD_PROBE_OK;
+    active = now_active;
+    activity_active = active;
+    last_event = now;
+
+    json event;
+    event["command"] = "ACTIVITY";
+    event["identifier"] = local_id;
+    event["active"] = active;
+    event["level"] = level;
+    g_idle_add(sendEvent, new string(event.dump()));
+    return GST_PAD_PROBE_OK;
+}
+
+static void install_activity_probe() {
+    GstElement* tee = gst_bin_get_by_name(GST_BIN(pipeline), "encodedtee");
+    g_assert_nonnull(tee);
+    GstPad* sinkpad = gst_element_get_static_pad(tee, "sink");
+    g_assert_nonnull(sinkpad);
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, onEncodedFrame, nullptr, nullptr);
+    gst_object_unref(sinkpad);
+    gst_object_unref(tee);
+}
+
+
+/* Answers GET_STATS with whatever the enabled features measure */
+static void sendStats(json data) {
+    string camera = data.value("camera", local_id);
+    json stats;
+    stats["peers"] = std::count_if(peers.begin(), peers.end(), [&camera](const Peer& peer) {
+        return peer.camera == camera;
+    });
+    if (pacing_factor > 0)
+        stats["pacer"] = pacer_stats(camera);
+    if (drop_frames)
+        stats["dropped_frames"] = dropper_stats(camera);
+    if (activity && camera == local_id) {
+        stats["activity"]["level"] = activity_level.load();
+        stats["activity"]["active"] = activity_active.load();
+    }
+
+    json reply;
+    reply["command"] = "STATS";
+    reply["identifier"] = camera;
+    reply["requester"] = data.value("identifier", "");
+    reply["stats"] = stats;
+    soup_websocket_connection_send_text(ws_conn, reply.dump().c_str());
+}
+
+
+/*
+ * Every PLI from every peer ends up as an upstream force-key-unit event.
+ * rpicamsrc and v4l2h264enc answer it with a full IDR, the spike intra
+ * refresh exists to avoid, and their cyclic refresh repairs a decoder that
+ * already has a picture, so requests are dropped. A viewer that just called
+ * has nothing to repair, browsers only start decoding on an IDR, so one
+ * request per second goes through until the encoder has sent one.
+ */
+static std::atomic<gint64> last_idr_request{0};
+
+static GstPadProbeReturn onKeyUnitRequest(GstPad* pad G_GNUC_UNUSED, GstPadProbeInfo* info, gpointer user_data G_GNUC_UNUSED) {
+    GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (!gst_event_has_name(event, "GstForceKeyUnit"))
+        return GST_PAD_PROBE_OK;
+
+    gint64 now = g_get_monotonic_time();
+    gint64 last = last_idr_request.load();
+    if (!idr_pending || now - last < G_USEC_PER_SEC || !last_idr_request.compare_exchange_strong(last, now)) {
+        LOG(LOG_DEBUG) << "Key unit request dropped, the encoder refreshes cyclically";
+        return GST_PAD_PROBE_DROP;
+    }
+
+    LOG(LOG_DEBUG) << "Key unit request let through, a new viewer waits for an IDR";
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn onEncodedKeyframe(GstPad* pad G_GNUC_UNUSED, GstPadProbeInfo* info, gpointer user_data G_GNUC_UNUSED) {
+    if (!GST_BUFFER_FLAG_IS_SET(GST_PAD_PROBE_INFO_BUFFER(info), GST_BUFFER_FLAG_DELTA_UNIT))
+        idr_pending = false;
+    return GST_PAD_PROBE_OK;
+}
+
+static bool has_cyclic_refresh_encoder(GstElement* bin) {
+    bool found = false;
+    GstIterator* it = gst_bin_iterate_recurse(GST_BIN(bin));
+    GValue item = G_VALUE_INIT;
+    while (!found && gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+        GstElementFactory* factory = gst_element_get_factory(GST_ELEMENT(g_value_get_object(&item)));
+        string name = factory ? GST_OBJECT_NAME(factory) : "";
+        found = name == "rpicamsrc" || name == "v4l2h264enc";
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(it);
+    return found;
+}
+
+static void install_key_unit_filter() {
+    if (!has_cyclic_refresh_encoder(pipeline)) {
+        LOG(LOG_WARNING) << "--intra-refresh needs rpicamsrc or v4l2h264enc, IDR frames are kept";
+        intra_refresh = false;
+        return;
+    }
+
+    GstElement* tee = gst_bin_get_by_name(GST_BIN(pipeline), "videotee");
+    g_assert_nonnull(tee);
+    GstPad* sinkpad = gst_element_get_static_pad(tee, "sink");
+    g_assert_nonnull(sinkpad);
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, onKeyUnitRequest, nullptr, nullptr);
+    gst_object_unref(sinkpad);
+    gst_object_unref(tee);
+
+    tee = gst_bin_get_by_name(GST_BIN(pipeline), "encodedtee");
+    g_assert_nonnull(tee);
+    sinkpad = gst_element_get_static_pad(tee, "sink");
+    g_assert_nonnull(sinkpad);
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, onEncodedKeyframe, nullptr, nullptr);
+    gst_object_unref(sinkpad);
+    gst_object_unref(tee);
+}
+
+
+/*
+ * Pre-roll buffer: the encoded stream is kept in RAM as references to the
+ * encoder's GstBuffers, starting on a keyframe and trimmed a whole GOP at a
+ * time so that the oldest frame is always decodable. Only buffers owned by a
+ * pool (hardware encoders with a handful of output buffers) are copied, as
+ * holding on to them would starve the encoder.
+ */
+static std::mutex preroll_mutex;
+static std::deque<GstBuffer*> preroll_buffers;
+static std::deque<GstClockTime> preroll_keyframes; /* timestamp of each GOP start */
+static gsize preroll_bytes = 0;
+static GstCaps* preroll_caps = nullptr;
+
+static void preroll_drop_gop() {
+    do {
+        GstBuffer* buffer = preroll_buffers.front();
+        preroll_bytes -= gst_buffer_get_size(buffer);
+        gst_buffer_unref(buffer);
+        preroll_buffers.pop_front();
+    } while (!preroll_buffers.empty() && GST_BUFFER_FLAG_IS_SET(preroll_buffers.front(), GST_BUFFER_FLAG_DELTA_UNIT));
+    preroll_keyframes.pop_front();
+}
+
+static GstPadProbeReturn onPrerollData(GstPad* pad G_GNUC_UNUSED, GstPadProbeInfo* info, gpointer user_data G_GNUC_UNUSED) {
+    std::lock_guard<std::mutex> lock(preroll_mutex);
+
+    if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps* caps;
+            gst_event_parse_caps(event, &caps);
+            gst_caps_replace(&preroll_caps, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstClockTime ts = GST_BUFFER_DTS_OR_PTS(buffer);
+    bool keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    if (!GST_CLOCK_TIME_IS_VALID(ts) || (!keyframe && preroll_buffers.empty()))
+        return GST_PAD_PROBE_OK;
+
+    buffer = buffer->pool ? gst_buffer_copy_deep(buffer) : gst_buffer_ref(buffer);
+    preroll_buffers.push_back(buffer);
+    preroll_bytes += gst_buffer_get_size(buffer);
+    if (keyframe)
+        preroll_keyframes.push_back(ts);
+
+    /* Keep at least the window, starting on the latest keyframe that covers it */
+    GstClockTime window = preroll_seconds * GST_SECOND;
+    while (preroll_keyframes.size() >= 2 && ts - preroll_keyframes[1] >= window)
+        preroll_drop_gop();
+
+    gsize max_bytes = static_cast<gsize>(preroll_max_mb) * 1024 * 1024;
+    while (!preroll_buffers.empty() && preroll_bytes > max_bytes)
+        preroll_drop_gop();
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void install_preroll_probe() {
+    GstElement* tee = gst_bin_get_by_name(GST_BIN(pipeline), "encodedtee");
+    g_assert_nonnull(tee);
+    GstPad* sinkpad = gst_element_get_static_pad(tee, "sink");
+    g_assert_nonnull(sinkpad);
+    gst_pad_add_probe(sinkpad, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        onPrerollData, nullptr, nullptr);
+    gst_object_unref(sinkpad);
+    gst_object_unref(tee);
+}
+
+
+struct Clip {
+    GstElement* pipeline;
+    string path;
+};
+
+static gboolean onClipBusMessage(GstBus* bus G_GNUC_UNUSED, GstMessage* message, gpointer user_data) {
+    Clip* clip = static_cast<Clip*>(user_data);
+
+    switch (GST_MESSAGE_TYPE(message)) {
+    case GST_MESSAGE_EOS: {
+        LOG(LOG_INFO) << "Clip saved: " << clip->path;
+        json saved;
+        saved["command"] = "CLIP_SAVED";
+        saved["identifier"] = local_id;
+        saved["path"] = clip->path;
+        if (ws_conn)
+            soup_websocket_connection_send_text(ws_conn, saved.dump().c_str());
+        break;
+    }
+    case GST_MESSAGE_ERROR: {
+        GError* error = nullptr;
+        gst_message_parse_error(message, &error, nullptr);
+        LOG(LOG_ERROR) << "Failed to save clip " << clip->path << ": " << error->message;
+        g_error_free(error);
+        break;
+    }
+    default:
+        return G_SOURCE_CONTINUE;
+    }
+
+    gst_element_set_state(clip->pipeline, GST_STATE_NULL);
+    gst_object_unref(clip->pipeline);
+    delete clip;
+    return G_SOURCE_REMOVE;
+}
+
+/* Muxes a snapshot of the pre-roll ring into an MP4 clip, off the live pipeline */
+static void saveClip(json data) {
+    vector<GstBuffer*> buffers;
+    GstCaps* caps = nullptr;
+    GError* error = nullptr;
+
+    if (data.value("camera", local_id) != local_id) {
+        LOG(LOG_WARNING) << "Clips are only kept for " << local_id;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(preroll_mutex);
+        /* Shallow copies so we can rebase timestamps, payloads are shared */
+        for (auto buffer : preroll_buffers)
+            buffers.push_back(gst_buffer_copy(buffer));
+        if (preroll_caps)
+            caps = gst_caps_ref(preroll_caps);
+    }
+
+    if (buffers.empty() || !caps) {
+        LOG(LOG_WARNING) << "No pre-roll to save";
+        for (auto buffer : buffers)
+            gst_buffer_unref(buffer);
+        if (caps)
+            gst_caps_unref(caps);
+        return;
+    }
+
+    GDateTime* now = g_date_time_new_now_local();
+    gchar* stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+    Clip* clip = new Clip{nullptr, clip_dir + "/clip-" + local_id + "-" + stamp + ".mp4"};
+    g_free(stamp);
+    g_date_time_unref(now);
+
+    string launch = "appsrc name=src format=time max-bytes=0 ! h264parse ! mp4mux ! filesink location=" + clip->path;
+    clip->pipeline = gst_parse_launch(launch.c_str(), &error);
+    if (error) {
+        LOG(LOG_ERROR) << "Failed to create clip pipeline: " << error->message;
+        g_error_free(error);
+        if (clip->pipeline)
+            gst_object_unref(clip->pipeline);
+        delete clip;
+        for (auto buffer : buffers)
+            gst_buffer_unref(buffer);
+        gst_caps_unref(caps);
+        return;
+    }
+
+    GstElement* src = gst_bin_get_by_name(GST_BIN(clip->pipeline), "src");
+    g_object_set(src, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+
+    GstBus* bus = gst_element_get_bus(clip->pipeline);
+    gst_bus_add_watch(bus, onClipBusMessage, clip);
+    gst_object_unref(bus);
+    gst_element_set_state(clip->pipeline, GST_STATE_PLAYING);
+
+    GstClockTime base = GST_BUFFER_DTS_OR_PTS(buffers.front());
+    for (auto buffer : buffers) {
+        GstFlowReturn flow;
+        if (GST_BUFFER_PTS_IS_VALID(buffer))
+            GST_BUFFER_PTS(buffer) -= base;
+        if (GST_BUFFER_DTS_IS_VALID(buffer))
+            GST_BUFFER_DTS(buffer) -= base;
+        g_signal_emit_by_name(src, "push-buffer", buffer, &flow);
+        gst_buffer_unref(buffer);
+    }
+    GstFlowReturn flow;
+    g_signal_emit_by_name(src, "end-of-stream", &flow);
+    gst_object_unref(src);
+
+    LOG(LOG_INFO) << "Saving " << buffers.size() << " pre-roll frames to " << clip->path;
+}
+
+
+/*
+ * Snapshots: the probe only keeps references to the GOP in progress. Nothing is
+ * decoded until someone asks, then the GOP is decoded with every frame but the
+ * last flagged decode-only, so a single frame is converted and JPEG encoded.
+ * The result is served to every request arriving within the TTL.
+ */
+static const gsize snapshot_max_bytes = 8 * 1024 * 1024;
+static std::mutex snapshot_mutex;
+static vector<GstBuffer*> snapshot_gop;
+static gsize snapshot_gop_bytes = 0;
+static GstCaps* snapshot_caps = nullptr;
+
+static GBytes* snapshot_jpeg = nullptr;
+static gint64 snapshot_time = 0;
+static GstElement* snapshot_pipeline = nullptr;
+static vector<std::function<void(GBytes*)>> snapshot_waiters;
+
+static void snapshot_clear_gop() {
+    for (auto buffer : snapshot_gop)
+        gst_buffer_unref(buffer);
+    snapshot_gop.clear();
+    snapshot_gop_bytes = 0;
+}
+
+static GstPadProbeReturn onSnapshotData(GstPad* pad G_GNUC_UNUSED, GstPadProbeInfo* info, gpointer user_data G_GNUC_UNUSED) {
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+
+    if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps* caps;
+            gst_event_parse_caps(event, &caps);
+            gst_caps_replace(&snapshot_caps, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        snapshot_clear_gop();
+    else if (snapshot_gop.empty() || snapshot_gop_bytes > snapshot_max_bytes)
+        return GST_PAD_PROBE_OK; /* waiting for a keyframe, or GOP too long */
+
+    buffer = buffer->pool ? gst_buffer_copy_deep(buffer) : gst_buffer_ref(buffer);
+    snapshot_gop.push_back(buffer);
+    snapshot_gop_bytes += gst_buffer_get_size(buffer);
+    return GST_PAD_PROBE_OK;
+}
+
+static void install_snapshot_probe() {
+    GstElement* tee = gst_bin_get_by_name(GST_BIN(pipeline), "encodedtee");
+    g_assert_nonnull(tee);
+    GstPad* sinkpad = gst_element_get_static_pad(tee, "sink");
+    g_assert_nonnull(sinkpad);
+    gst_pad_add_probe(sinkpad, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        onSnapshotData, nullptr, nullptr);
+    gst_object_unref(sinkpad);
+    gst_object_unref(tee);
+}
+
+static void snapshot_done(GBytes* jpeg) {
+    if (jpeg) {
+        if (snapshot_jpeg)
+            g_bytes_unref(snapshot_jpeg);
+        snapshot_jpeg = jpeg;
+        snapshot_time = g_get_monotonic_time();
+    }
+
+    auto waiters = std::move(snapshot_waiters);
+    snapshot_waiters.clear();
+    for (auto& waiter : waiters)
+        waiter(jpeg);
+}
+
+static gboolean onSnapshotBusMessage(GstBus* bus G_GNUC_UNUSED, GstMessage* message, gpointer user_data G_GNUC_UNUSED) {
+    GBytes* jpeg = nullptr;
+
+    switch (GST_MESSAGE_TYPE(message)) {
+    case GST_MESSAGE_EOS: {
+        GstElement* sink = gst_bin_get_by_name(GST_BIN(snapshot_pipeline), "sink");
+        GstSample* sample = nullptr;
+        g_signal_emit_by_name(sink, "pull-sample", &sample);
+        gst_object_unref(sink);
+        if (sample) {
+            GstMapInfo map;
+            GstBuffer* buffer = gst_sample_get_buffer(sample);
+            if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+                jpeg = g_bytes_new(map.data, map.size);
+                gst_buffer_unmap(buffer, &map);
+            }
+            gst_sample_unref(sample);
+        }
+        break;
+    }
+    case GST_MESSAGE_ERROR: {
+        GError* error = nullptr;
+        gst_message_parse_error(message, &error, nullptr);
+        LOG(LOG_ERROR) << "Snapshot failed: " << error->message;
+        g_error_free(error);
+        break;
+    }
+    default:
+        return G_SOURCE_CONTINUE;
+    }
+
+    gst_element_set_state(snapshot_pipeline, GST_STATE_NULL);
+    gst_object_unref(snapshot_pipeline);
+    snapshot_pipeline = nullptr;
+    snapshot_done(jpeg);
+    return G_SOURCE_REMOVE;
+}
+
+/* Calls done with the JPEG (nullptr on failure), always from the main loop */
+static void requestSnapshot(std::function<void(GBytes*)> done) {
+    if (snapshot_jpeg && g_get_monotonic_time() - snapshot_time < snapshot_ttl * 1000) {
+        done(snapshot_jpeg);
+        return;
+    }
+
+    snapshot_waiters.push_back(done);
+    if (snapshot_pipeline)
+        return; /* already decoding, will be served with the others */
+
+    vector<GstBuffer*> buffers;
+    GstCaps* caps = nullptr;
+    GError* error = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        for (auto buffer : snapshot_gop)
+            buffers.push_back(gst_buffer_copy(buffer));
+        if (snapshot_caps)
+            caps = gst_caps_ref(snapshot_caps);
+    }
+
+    if (buffers.empty() || !caps) {
+        if (caps)
+            gst_caps_unref(caps);
+        snapshot_done(nullptr);
+        return;
+    }
+
+    snapshot_pipeline = gst_parse_launch("appsrc name=src format=time max-bytes=0 ! decodebin ! videoconvert"
+        " ! jpegenc quality=80 ! appsink name=sink sync=false max-buffers=1 drop=true", &error);
+    if (error) {
+        LOG(LOG_ERROR) << "Failed to create snapshot pipeline: " << error->message;
+        g_error_free(error);
+        g_clear_object(&snapshot_pipeline);
+        for (auto buffer : buffers)
+            gst_buffer_unref(buffer);
+        gst_caps_unref(caps);
+        snapshot_done(nullptr);
+        return;
+    }
+
+    GstElement* src = gst_bin_get_by_name(GST_BIN(snapshot_pipeline), "src");
+    g_object_set(src, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+
+    GstBus* bus = gst_element_get_bus(snapshot_pipeline);
+    gst_bus_add_watch(bus, onSnapshotBusMessage, nullptr);
+    gst_object_unref(bus);
+    gst_element_set_state(snapshot_pipeline, GST_STATE_PLAYING);
+
+    for (size_t i = 0; i < buffers.size(); i++) {
+        GstFlowReturn flow;
+        if (i + 1 < buffers.size())
+            GST_BUFFER_FLAG_SET(buffers[i], GST_BUFFER_FLAG_DECODE_ONLY);
+        g_signal_emit_by_name(src, "push-buffer", buffers[i], &flow);
+        gst_buffer_unref(buffers[i]);
+    }
+    GstFlowReturn flow;
+    g_signal_emit_by_name(src, "end-of-stream", &flow);
+    gst_object_unref(src);
+}
+
+static void sendSnapshot(json data) {
+    if (data.value("camera", local_id) != local_id) {
+        LOG(LOG_WARNING) << "Snapshots are only taken from " << local_id;
+        return;
+    }
+
+    string requester = data.value("identifier", "");
+    requestSnapshot([requester](GBytes* jpeg) {
+        json reply;
+        reply["command"] = "SNAPSHOT";
+        reply["identifier"] = local_id;
+        reply["requester"] = requester;
+        if (jpeg) {
+            gsize size;
+            const guchar* bytes = static_cast<const guchar*>(g_bytes_get_data(jpeg, &size));
+            gchar* encoded = g_base64_encode(bytes, size);
+            reply["jpeg"] = encoded;
+            g_free(encoded);
+        } else {
+            reply["error"] = "no frame available";
+        }
+        if (ws_conn)
+            soup_websocket_connection_send_text(ws_conn, reply.dump().c_str());
+    });
+}
+
+static void onSnapshotHttpRequest(SoupServer* server, SoupMessage* msg, const char* path G_GNUC_UNUSED,
+        GHashTable* query G_GNUC_UNUSED, SoupClientContext* client G_GNUC_UNUSED, gpointer user_data G_GNUC_UNUSED) {
+    if (msg->method != SOUP_METHOD_GET) {
+        soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+        return;
+    }
+
+    /* Answered from the main loop once the snapshot is ready */
+    g_object_ref(msg);
+    soup_server_pause_message(server, msg);
+    requestSnapshot([server, msg](GBytes* jpeg) {
+        if (jpeg) {
+            gsize size;
+            const char* bytes = static_cast<const char*>(g_bytes_get_data(jpeg, &size));
+            soup_message_set_status(msg, SOUP_STATUS_OK);
+            soup_message_set_response(msg, "image/jpeg", SOUP_MEMORY_COPY, bytes, size);
+        } else {
+            soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+        }
+        soup_server_unpause_message(server, msg);
+        g_object_unref(msg);
+    });
+}
+
+static gboolean onSnapshotAuth(SoupAuthDomain* domain G_GNUC_UNUSED, SoupMessage* msg G_GNUC_UNUSED,
+        const char* username, const char* password, gpointer user_data G_GNUC_UNUSED) {
+    return http_user == username && http_password == password;
+}
+
+/* Loopback only unless --snapshot-address says otherwise, and behind the
+ * --http-auth credentials when they are given */
+static bool start_snapshot_server() {
+    GError* error = nullptr;
+    GSocketAddress* address = g_inet_socket_address_new_from_string(snapshot_address.c_str(), snapshot_port);
+    if (!address) {
+        LOG(LOG_ERROR) << "Invalid snapshot server address: " << snapshot_address;
+        return false;
+    }
+
+    SoupServer* server = soup_server_new(nullptr, nullptr);
+    soup_server_add_handler(server, "/snapshot.jpg", onSnapshotHttpRequest, nullptr, nullptr);
+    if (use_http_auth) {
+        SoupAuthDomain* domain = soup_auth_domain_basic_new(SOUP_AUTH_DOMAIN_REALM, "omniroom",
+            SOUP_AUTH_DOMAIN_BASIC_AUTH_CALLBACK, onSnapshotAuth, SOUP_AUTH_DOMAIN_ADD_PATH, "/", nullptr);
+        soup_server_add_auth_domain(server, domain);
+        g_object_unref(domain);
+    }
+
+    bool listening = soup_server_listen(server, address, static_cast<SoupServerListenOptions>(0), &error);
+    g_object_unref(address);
+    if (!listening) {
+        LOG(LOG_ERROR) << "Failed to start snapshot server: " << error->message;
+        g_error_free(error);
+        g_object_unref(server);
+        return false;
+    }
+    LOG(LOG_INFO) << "Serving snapshots on http://" << snapshot_address << ":" << snapshot_port << "/snapshot.jpg"
+        << (use_http_auth ? " with basic authentication" : "");
+    return true;
+}
+
+
+/*
+ * Relay mode: this node calls relay_source like a viewer would, and the RTP
+ * coming out of that single upstream webrtcbin feeds videotee. Viewers are
+ * then served exactly like by a camera, packets are only forwarded and
+ * re-encrypted per viewer, never decoded. Viewer PLIs travel up the tee and
+ * become a PLI to the camera.
+ */
+static string relay_pipeline() {
+    return "webrtcbin name=upstream bundle-policy=max-bundle tee name=videotee allow-not-linked=true ! queue ! fakesink"
+        " tee name=audiotee allow-not-linked=true ! queue ! fakesink";
+}
+
+/* Video goes to videotee and audio to audiotee, anything else is discarded */
+static void onUpstreamPad(GstElement* webrtc G_GNUC_UNUSED, GstPad* pad, gpointer user_data G_GNUC_UNUSED) {
+    int ret;
+    if (GST_PAD_DIRECTION(pad) != GST_PAD_SRC)
+        return;
+
+    GstCaps* caps = gst_pad_get_current_caps(pad);
+    if (!caps)
+        caps = gst_pad_query_caps(pad, nullptr);
+    const gchar* field = gst_caps_get_size(caps) ? gst_structure_get_string(gst_caps_get_structure(caps, 0), "media") : nullptr;
+    string media = field ? field : "";
+    gst_caps_unref(caps);
+    string tee_name = media == "video" ? "videotee" : media == "audio" ? "audiotee" : "";
+
+    GstElement* tee = tee_name.empty() ? nullptr : gst_bin_get_by_name(GST_BIN(pipeline), tee_name.c_str());
+    GstPad* teepad = tee ? gst_element_get_static_pad(tee, "sink") : nullptr;
+    if (teepad && gst_pad_is_linked(teepad)) {
+        gst_object_unref(teepad);
+        teepad = nullptr;
+    }
+
+    GstElement* q = gst_element_factory_make("queue", nullptr);
+    g_assert_nonnull(q);
+    gst_bin_add(GST_BIN(pipeline), q);
+    if (teepad) {
+        ret = gst_element_link(q, tee);
+        g_assert_true(ret);
+    } else {
+        GstElement* sink = gst_element_factory_make("fakesink", nullptr);
+        g_assert_nonnull(sink);
+        gst_bin_add(GST_BIN(pipeline), sink);
+        ret = gst_element_link(q, sink);
+        g_assert_true(ret);
+        ret = gst_element_sync_state_with_parent(sink);
+        g_assert_true(ret);
+    }
+    ret = gst_element_sync_state_with_parent(q);
+    g_assert_true(ret);
+
+    GstPad* sinkpad = gst_element_get_static_pad(q, "sink");
+    ret = gst_pad_link(pad, sinkpad);
+    g_assert_cmpint(ret, ==, GST_PAD_LINK_OK);
+    gst_object_unref(sinkpad);
+
+    if (!teepad) {
+        LOG(LOG_WARNING) << "Discarding " << (media.empty() ? "unknown " : "extra " + media + " ") << "stream from " << relay_source;
+    } else if (tee_name == "audiotee") {
+        /* Viewers that call from now on get an audio track as well */
+        relay_audio = true;
+        LOG(LOG_INFO) << "Relaying audio from " << relay_source;
+    } else {
+        LOG(LOG_INFO) << "Relaying stream from " << relay_source;
+    }
+    if (teepad)
+        gst_object_unref(teepad);
+    if (tee)
+        gst_object_unref(tee);
+}
+
+static void sendUpstreamICECandidate(GstElement* webrtc G_GNUC_UNUSED, guint mlineindex, gchar* candidate, gpointer user_data G_GNUC_UNUSED) {
+    json ice;
+    ice["command"] = "ICE_ANSWER";
+    ice["identifier"] = relay_source;
+    ice["ice"]["candidate"] = candidate;
+    ice["ice"]["sdpMLineIndex"] = mlineindex;
+    soup_websocket_connection_send_text(ws_conn, ice.dump().c_str());
+}
+
+static void onUpstreamAnswerCreated(GstPromise* promise, gpointer user_data G_GNUC_UNUSED) {
+    GstWebRTCSessionDescription* answer = nullptr;
+    ScopedTrace trace("onUpstreamAnswerCreated");
+
+    g_assert_cmpint(gst_promise_wait(promise), ==, GST_PROMISE_RESULT_REPLIED);
+    gst_structure_get(gst_promise_get_reply(promise), "answer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, nullptr);
+    gst_promise_unref(promise);
+
+    GstElement* webrtc = gst_bin_get_by_name(GST_BIN(pipeline), "upstream");
+    g_assert_nonnull(webrtc);
+    promise = gst_promise_new();
+    g_signal_emit_by_name(webrtc, "set-local-description", answer, promise);
+    gst_promise_interrupt(promise);
+    gst_promise_unref(promise);
+    gst_object_unref(webrtc);
+
+    gchar* text = gst_sdp_message_as_text(answer->sdp);
+    LOG(LOG_INFO) << "Sending sdp answer to " << relay_source;
+    LOG(LOG_DEBUG) << "Answer:\n" << text;
+
+    json sdp;
+    sdp["command"] = "SDP_ANSWER";
+    sdp["identifier"] = relay_source;
+    sdp["offer"]["type"] = "answer";
+    sdp["offer"]["sdp"] = text;
+    soup_websocket_connection_send_text(ws_conn, sdp.dump().c_str());
+    g_free(text);
+    gst_webrtc_session_description_free(answer);
+}
+
+static void onUpstreamRemoteSet(GstPromise* promise, gpointer user_data G_GNUC_UNUSED) {
+    gst_promise_unref(promise);
+
+    GstElement* webrtc = gst_bin_get_by_name(GST_BIN(pipeline), "upstream");
+    g_assert_nonnull(webrtc);
+    promise = gst_promise_new_with_change_func(onUpstreamAnswerCreated, nullptr, nullptr);
+    g_signal_emit_by_name(webrtc, "create-answer", nullptr, promise);
+    gst_object_unref(webrtc);
+}
+
+static void onUpstreamOffer(json data) {
+    int ret;
+    GstSDPMessage* sdp;
+    ScopedTrace trace("onUpstreamOffer");
 
-    /* This is the gstwebrtc entry point where we create the offer and so on. It
-     * will be called when the pipeline goes to PLAYING.
-     * XXX: We must connect this after webrtcbin has been linked to a source via
-     * get_request_pad() and before we go from NULL->READY otherwise webrtcbin
-     * will create an SDP offer with no media lines in it. */
-    peers.push_back(peer_id);
-    if (offer) {
-        cout << "Offer" << endl;
-        g_signal_connect(webrtc, "on-negotiation-needed", G_CALLBACK(onNegotiationNeeded), static_cast<gpointer>(&(peers.back())));
-    } else {
-        cout << "No offer" << endl;
+    if (data["identifier"] != relay_source) {
+        LOG(LOG_WARNING) << "Ignoring offer from " << data["identifier"];
+        return;
     }
+    LOG(LOG_INFO) << "Received SDP offer from " << relay_source;
+    LOG(LOG_DEBUG) << "Offer:\n" << data["offer"];
 
-    /* We need to transmit this ICE candidate to the browser via the websockets
-     * signalling server. Incoming ice candidates from the browser need to be
-     * added by us too, see on_server_message() */
-    g_signal_connect(webrtc, "on-ice-candidate", G_CALLBACK(sendICECandidate), static_cast<gpointer>(&(peers.back())));
+    ret = gst_sdp_message_new(&sdp);
+    g_assert_cmpint(ret, ==, GST_SDP_OK);
+    string text = data["offer"]["sdp"].get<string>();
+    ret = gst_sdp_message_parse_buffer(reinterpret_cast<const guint8*>(text.data()), text.size(), sdp);
+    if (ret != GST_SDP_OK) {
+        LOG(LOG_ERROR) << "Invalid offer from " << relay_source;
+        gst_sdp_message_free(sdp);
+        return;
+    }
 
-    /* Set to pipeline branch to PLAYING */
-    ret = gst_element_sync_state_with_parent(q);
-    g_assert_true(ret);
-    ret = gst_element_sync_state_with_parent(webrtc);
-    g_assert_true(ret);
+    GstWebRTCSessionDescription* offer = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_OFFER, sdp);
+    GstElement* webrtc = gst_bin_get_by_name(GST_BIN(pipeline), "upstream");
+    g_assert_nonnull(webrtc);
+    GstPromise* promise = gst_promise_new_with_change_func(onUpstreamRemoteSet, nullptr, nullptr);
+    g_signal_emit_by_name(webrtc, "set-remote-description", offer, promise);
+    gst_object_unref(webrtc);
+    gst_webrtc_session_description_free(offer);
 }
 
+static void onUpstreamICECandidate(json data) {
+    if (data["identifier"] != relay_source)
+        return;
 
-static void callPeer(json data) {
-    cout << "Calling peer... " << data["identifier"].get<string>() << endl;
-    add_peer_to_pipeline(data["identifier"].get<string>(), true);
+    string candidate = data["ice"]["candidate"];
+    gint sdpmlineindex = data["ice"]["sdpMLineIndex"];
+    GstElement* webrtc = gst_bin_get_by_name(GST_BIN(pipeline), "upstream");
+    g_assert_nonnull(webrtc);
+    g_signal_emit_by_name(webrtc, "add-ice-candidate", sdpmlineindex, candidate.c_str());
+    gst_object_unref(webrtc);
+}
+
+/* Asks the signalling server to connect us to the camera, as a viewer */
+static void call_upstream() {
+    GstElement* webrtc = gst_bin_get_by_name(GST_BIN(pipeline), "upstream");
+    g_assert_nonnull(webrtc);
+    g_signal_connect(webrtc, "pad-added", G_CALLBACK(onUpstreamPad), nullptr);
+    g_signal_connect(webrtc, "on-ice-candidate", G_CALLBACK(sendUpstreamICECandidate), nullptr);
+    gst_object_unref(webrtc);
+
+    json call;
+    call["command"] = "CALL";
+    call["identifier"] = relay_source;
+    soup_websocket_connection_send_text(ws_conn, call.dump().c_str());
+    LOG(LOG_INFO) << "Calling upstream camera " << relay_source;
 }
 
+
 static gboolean start_pipeline(void) {
     GstStateChangeReturn ret;
     GError *error = nullptr;
+    ScopedTrace trace("start_pipeline");
 
     /* NOTE: webrtcbin currently does not support dynamic addition/removal of
      * streams, so we use a separate webrtcbin for each peer, but all of them are
      * inside the same pipeline. We start by connecting it to a fakesink so that
-     * we can preroll early. */
-    const string pipeline_stream = input_stream + " ! " + payload_stream + " ! queue ! tee name=videotee ! queue ! fakesink";
-    cout << "Pipeline: " << pipeline_stream << endl;
+     * we can preroll early. Branches that need the encoded stream rather than
+     * RTP hang off encodedtee. */
+    const string pipeline_stream = !relay_source.empty() ? relay_pipeline()
+        : input_stream + " ! tee name=encodedtee ! queue ! " + payload_stream
+        + " ! queue ! tee name=videotee ! queue ! fakesink" + recording_branch() + thumbnail_branch()
+        + motion_branch() + audio_branch();
+    LOG(LOG_INFO) << "Pipeline: " << pipeline_stream;
     pipeline = gst_parse_launch(pipeline_stream.c_str(), &error);
 
     if (error) {
-        g_printerr("Failed to parse launch: %s\n", error->message);
+        LOG(LOG_ERROR) << "Failed to parse launch: " << error->message;
         g_error_free(error);
         goto err;
     }
 
-    g_print("Starting pipeline, not transmitting yet\n");
+    configure_payloaders(pipeline);
+
+    if (intra_refresh)
+        install_key_unit_filter();
+
+    if (preroll_seconds > 0)
+        install_preroll_probe();
+
+    if (snapshots)
+        install_snapshot_probe();
+
+    if (motion)
+        install_motion_probe();
+
+    if (activity)
+        install_activity_probe();
+
+    LOG(LOG_INFO) << "Starting pipeline, not transmitting yet";
     ret = gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_PLAYING);
     if (ret == GST_STATE_CHANGE_FAILURE)
         goto err;
 
+    camera_pipelines[local_id] = pipeline;
     return true;
 
 err:
-    g_print("State change failure\n");
+    LOG(LOG_ERROR) << "State change failure";
     if (pipeline)
         g_clear_object(&pipeline);
     return false;
 }
 
 
+/*
+ * Extra cameras get a pipeline of their own, so their element names do not
+ * clash with the primary one, but share the process: one main loop, one
+ * signalling connection, one plugin registry and one DTLS certificate, which
+ * webrtcbin generates once per process. They only carry the main stream.
+ */
+static bool start_camera(const string& camera, const string& stream) {
+    GError *error = nullptr;
+
+    const string camera_stream = stream + " ! queue ! " + payload_stream + " ! queue ! tee name=videotee ! queue ! fakesink";
+    LOG(LOG_INFO) << "Pipeline of " << camera << ": " << camera_stream;
+    GstElement* bin = gst_parse_launch(camera_stream.c_str(), &error);
+    if (error) {
+        LOG(LOG_ERROR) << "Failed to parse launch of " << camera << ": " << error->message;
+        g_error_free(error);
+        if (bin)
+            gst_object_unref(bin);
+        return false;
+    }
+
+    configure_payloaders(bin);
+    if (gst_element_set_state(bin, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        LOG(LOG_ERROR) << "State change failure of " << camera;
+        gst_object_unref(bin);
+        return false;
+    }
+    camera_pipelines[camera] = bin;
+    return true;
+}
+
+
+/* Pipelines are built in a thread of their own while we connect, the
+ * cameras only join once both are done so a CALL always finds them running */
+static bool pipelines_started = false;
+static bool pipelines_failed = false;
+
 static bool join() {
-    if (soup_websocket_connection_get_state(ws_conn) != SOUP_WEBSOCKET_STATE_OPEN)
+    if (!pipelines_started || !ws_conn || soup_websocket_connection_get_state(ws_conn) != SOUP_WEBSOCKET_STATE_OPEN)
         return false;
 
-    cout << "Registering id " << local_id << " with server" << endl;
     app_state = SERVER_REGISTERING;
 
-    string m = "{\"command\": \"JOIN_CAMERA\", \"identifier\": \"" + local_id + "\"}";
-    soup_websocket_connection_send_text(ws_conn, m.c_str());
+    /* Every camera of the process registers over the same connection */
+    joining_cameras.assign(1, local_id);
+    for (auto& camera : extra_cameras)
+        joining_cameras.push_back(camera.first);
+    for (auto& camera : joining_cameras) {
+        LOG(LOG_INFO) << "Registering id " << camera << " with server";
+        string m = "{\"command\": \"JOIN_CAMERA\", \"identifier\": \"" + camera + "\"}";
+        soup_websocket_connection_send_text(ws_conn, m.c_str());
+    }
     return true;
 }
 
 
+/*
+ * webrtcbin generates its DTLS certificate once per process, in the first
+ * dtlsdec it creates. Creating one now moves the key generation off the first
+ * CALL and overlaps it with the signalling connection.
+ */
+static void generate_certificate() {
+    gint64 start = g_get_monotonic_time();
+    GstElement* dtlsdec = gst_element_factory_make("dtlsdec", nullptr);
+    if (dtlsdec)
+        gst_object_unref(dtlsdec);
+    certificate_time = g_get_monotonic_time() - start;
+}
+
+
 static void doRegistration(json data) {
-    app_state = SERVER_REGISTERED;
-    if (!start_pipeline())
-          cleanup_and_quit_loop("ERROR: failed to start pipeline", ROOM_CALL_ERROR);
-    cout << "Registered with server" << endl;
+    /* Servers that do not echo the id answer in the order the cameras joined */
+    auto joining = std::find(joining_cameras.begin(), joining_cameras.end(), data.value("identifier", ""));
+    if (joining == joining_cameras.end())
+        joining = joining_cameras.begin();
+    if (joining == joining_cameras.end())
+        return;
+    string camera = *joining;
+    joining_cameras.erase(joining);
+
+    /* Replies come in any order, a late one must not undo a negotiation that
+     * another camera already started */
+    app_state = std::max(app_state, SERVER_REGISTERED);
+
+    /* Pipelines were started before joining, they are already running */
+    if (camera != local_id) {
+        LOG(LOG_INFO) << "Registered " << camera << " with server";
+        return;
+    }
+
+    startup_mark("registration");
+    LOG(LOG_INFO) << "Registered with server";
+    log_startup();
+
+    if (!relay_source.empty())
+        call_upstream();
 }
 
 
@@ -336,10 +2721,12 @@ static void onSDPAnswer(json data) {
     GstElement *webrtc;
     GstSDPMessage *sdp;
     GstWebRTCSessionDescription *answer;
+    ScopedTrace trace("onSDPAnswer");
 
     g_assert_cmpint(app_state, >=, ROOM_CALL_OFFERING);
 
-    cout << "Received SDP answer: " << endl << data["offer"] << endl;
+    LOG(LOG_INFO) << "Received SDP answer from " << data["identifier"].get<string>();
+    LOG(LOG_DEBUG) << "Answer:\n" << data["offer"];
 
     ret = gst_sdp_message_new(&sdp);
     g_assert_cmpint(ret, ==, GST_SDP_OK);
@@ -355,11 +2742,16 @@ static void onSDPAnswer(json data) {
     g_assert_nonnull(answer);
 
     string identifier = data["identifier"];
+    GstElement* bin = camera_pipeline(data.value("camera", local_id));
+    webrtc = bin ? gst_bin_get_by_name(GST_BIN(bin), identifier.c_str()) : nullptr;
+    if (!webrtc) {
+        LOG(LOG_WARNING) << "SDP answer for unknown peer " << identifier;
+        gst_webrtc_session_description_free(answer);
+        return;
+    }
 
     /* Set remote description on our pipeline */
     promise = gst_promise_new();
-    webrtc = gst_bin_get_by_name(GST_BIN(pipeline), identifier.c_str());
-    g_assert_nonnull(webrtc);
     g_signal_emit_by_name(webrtc, "set-remote-description", answer, promise);
     gst_object_unref(webrtc);
     /* We don't want to be notified when the action is done */
@@ -369,16 +2761,60 @@ static void onSDPAnswer(json data) {
 
 
 static void onICEAnswer(json data) {
-    cout << "Received ICE Answer" << endl;
+    ScopedTrace trace("onICEAnswer");
+    LOG(LOG_DEBUG) << "Received ICE Answer";
     string identifier = data["identifier"];
     string candidate = data["ice"]["candidate"];
     gint sdpmlineindex = data["ice"]["sdpMLineIndex"];
 
     /* Add ice candidate sent by remote peer */
-    GstElement* webrtc = gst_bin_get_by_name(GST_BIN(pipeline), identifier.c_str());
-    g_assert_nonnull(webrtc);
+    GstElement* bin = camera_pipeline(data.value("camera", local_id));
+    GstElement* webrtc = bin ? gst_bin_get_by_name(GST_BIN(bin), identifier.c_str()) : nullptr;
+    if (!webrtc) {
+        LOG(LOG_WARNING) << "ICE candidate for unknown peer " << identifier;
+        return;
+    }
     g_signal_emit_by_name(webrtc, "add-ice-candidate", sdpmlineindex, candidate.c_str());
     gst_object_unref(webrtc);
+
+    /* All viewers share the payloaders, so the smallest path wins. It is
+     * never raised again, and 500 bytes is a floor against bogus routes. */
+    guint mtu = rtp_mtu_auto ? path_rtp_mtu(candidate) : 0;
+    if (mtu >= 500 && mtu < (rtp_mtu ? rtp_mtu : rtp_default_mtu)) {
+        LOG(LOG_INFO) << "RTP packets lowered to " << mtu << " bytes for the path to " << identifier;
+        rtp_mtu = mtu;
+        for (auto& camera : camera_pipelines)
+            configure_payloaders(camera.second);
+    }
+}
+
+
+/* Main thread side of start_pipelines(), started tells whether all of them run */
+static gboolean onPipelinesStarted(gpointer started) {
+    if (!GPOINTER_TO_INT(started)) {
+        pipelines_failed = true;
+        return cleanup_and_quit_loop("Failed to start pipeline", APP_STATE_ERROR);
+    }
+
+    pipelines_started = true;
+    startup_mark("pipeline");
+    join();
+    return G_SOURCE_REMOVE;
+}
+
+/* Parsing, plugin loading and opening the sensor and the encoder block for a
+ * while, running them here overlaps them with the websocket handshake that
+ * the main loop drives meanwhile */
+static void start_pipelines() {
+    bool started = start_pipeline();
+    for (auto& camera : extra_cameras)
+        started = started && start_camera(camera.first, camera.second);
+    g_idle_add(onPipelinesStarted, GINT_TO_POINTER(started));
+}
+
+
+static gboolean onStopSignal(gpointer user_data G_GNUC_UNUSED) {
+    return cleanup_and_quit_loop("Stopping", APP_STATE_UNKNOWN);
 }
 
 
@@ -389,18 +2825,30 @@ static void onClose(SoupWebsocketConnection* conn G_GNUC_UNUSED, gpointer user_d
 
 
 static void onMessage(SoupWebsocketConnection* conn, SoupWebsocketDataType type, GBytes* message, gpointer user_data) {
+    ScopedTrace trace("onMessage");
     if (type == SOUP_WEBSOCKET_DATA_TEXT) {
         gsize size;
         string raw_data = static_cast<const char*>(g_bytes_get_data(message, &size));
         json data = json::parse(raw_data);
 
+        /* One connection carries every camera, untagged messages are for local_id.
+         * In relay mode the upstream camera's offer and candidates carry its own id. */
+        string camera = data.value("camera", local_id);
+        string command = data.value("command", "");
+        bool upstream = !relay_source.empty() && camera == relay_source && (command == "SDP_OFFER" || command == "ICE_CANDIDATE");
+        if (camera != local_id && !upstream && extra_cameras.find(camera) == extra_cameras.end()) {
+            LOG(LOG_WARNING) << "Message for unknown camera " << camera;
+            return;
+        }
+
         if (commandsMapping.find(data["command"].get<string>()) != commandsMapping.end()) {
             commandsMapping[data["command"].get<string>()](data);
         } else {
-            cout << "Command not found: " << data << endl;
+            LOG(LOG_WARNING) << "Command not found: " << data["command"];
+            LOG(LOG_DEBUG) << "Message: " << data;
         }
     } else {
-        cout << "Received unknown binary message, ignoring" << endl;
+        LOG(LOG_WARNING) << "Received unknown binary message, ignoring";
     }
 }
 
@@ -418,7 +2866,12 @@ static void onOpen(SoupSession * session, GAsyncResult * res, SoupMessage *msg)
     g_assert_nonnull(ws_conn);
 
     app_state = SERVER_CONNECTED;
-    g_print("Connected to signalling server\n");
+    startup_mark("connect");
+    LOG(LOG_INFO) << "Connected to signalling server";
+
+    /* A single ping keeps the connection of all cameras alive */
+    if (keepalive_interval)
+        soup_websocket_connection_set_keepalive_interval(ws_conn, keepalive_interval);
 
     g_signal_connect(ws_conn, "closed", G_CALLBACK(onClose), nullptr);
     g_signal_connect(ws_conn, "message", G_CALLBACK(onMessage), nullptr);
@@ -426,6 +2879,11 @@ static void onOpen(SoupSession * session, GAsyncResult * res, SoupMessage *msg)
 }
 
 
+static void soupLogPrinter(SoupLogger* logger G_GNUC_UNUSED, SoupLoggerLogLevel level G_GNUC_UNUSED, char direction, const char* data, gpointer user_data G_GNUC_UNUSED) {
+    LOG(LOG_DEBUG) << direction << " " << data;
+}
+
+
 /*
  * Connect to the signalling server. This is the entrypoint for everything else.
  */
@@ -435,9 +2893,13 @@ static void connect() {
       SOUP_SESSION_SSL_USE_SYSTEM_CA_FILE, TRUE,
       SOUP_SESSION_HTTPS_ALIASES, https_aliases, NULL);
 
-    SoupLogger* logger = soup_logger_new(SOUP_LOGGER_LOG_BODY, -1);
-    soup_session_add_feature(session, SOUP_SESSION_FEATURE(logger));
-    g_object_unref(logger);
+    /* Every websocket body goes through here, only worth it when debugging */
+    if (log_level >= LOG_DEBUG) {
+        SoupLogger* logger = soup_logger_new(SOUP_LOGGER_LOG_BODY, -1);
+        soup_logger_set_printer(logger, soupLogPrinter, nullptr, nullptr);
+        soup_session_add_feature(session, SOUP_SESSION_FEATURE(logger));
+        g_object_unref(logger);
+    }
 
     string protocol;
     if(use_ssl) {
@@ -456,7 +2918,7 @@ static void connect() {
         soup_uri_set_password(uri, http_password.c_str());
     }
 
-    cout << "Connecting to server: " << server_url << endl;
+    LOG(LOG_INFO) << "Connecting to server: " << server_url;
 
     /* Once connected, we will register */
     soup_session_websocket_connect_async(session, message, nullptr, nullptr, nullptr, (GAsyncReadyCallback) onOpen, message);
@@ -469,14 +2931,20 @@ static bool check_plugins(void) {
     gboolean ret;
     GstPlugin *plugin;
     GstRegistry *registry;
-    const vector<string> needed = {"opus", "nice", "webrtc", "dtls", "srtp", "rtpmanager", "audiotestsrc"};
+    /* Only what webrtcbin and the configured branches use, the launch
+     * strings report their own missing elements when parsed */
+    vector<string> needed = {"nice", "webrtc", "dtls", "srtp", "rtpmanager"};
+    if (!audio_stream.empty())
+        needed.push_back("opus");
+    if (audio_stream.compare(0, 12, "audiotestsrc") == 0)
+        needed.push_back("audiotestsrc");
 
     registry = gst_registry_get();
     ret = true;
     for (auto need : needed) {
         plugin = gst_registry_find_plugin(registry, need.c_str());
         if (!plugin) {
-            cout << "Required gstreamer plugin " << need << " not found" << endl;
+            LOG(LOG_ERROR) << "Required gstreamer plugin " << need << " not found";
             ret = false;
             continue;
         }
@@ -486,6 +2954,155 @@ static bool check_plugins(void) {
 }
 
 
+struct CaptureDevice {
+    string path;
+    bool h264; /* camera encodes H.264 itself, e.g. most UVC webcams */
+    bool raw;
+    bool jpeg; /* MJPEG, many cheap UVC webcams offer nothing else at useful sizes */
+};
+
+static vector<CaptureDevice> probe_capture_devices() {
+    vector<CaptureDevice> found;
+    GstDeviceMonitor* monitor = gst_device_monitor_new();
+    gst_device_monitor_add_filter(monitor, "Video/Source", nullptr);
+
+    GstCaps* h264_caps = gst_caps_from_string("video/x-h264");
+    GstCaps* raw_caps = gst_caps_from_string("video/x-raw");
+    GstCaps* jpeg_caps = gst_caps_from_string("image/jpeg");
+
+    GList* devices = gst_device_monitor_get_devices(monitor);
+    for (GList* item = devices; item; item = item->next) {
+        GstDevice* device = GST_DEVICE(item->data);
+        GstStructure* props = gst_device_get_properties(device);
+        if (props) {
+            /* Key depends on the GStreamer version */
+            const gchar* path = gst_structure_get_string(props, "api.v4l2.path");
+            if (!path)
+                path = gst_structure_get_string(props, "device.path");
+
+            GstCaps* caps = gst_device_get_caps(device);
+            if (path && caps) {
+                found.push_back({path, gst_caps_can_intersect(caps, h264_caps) == TRUE,
+                    gst_caps_can_intersect(caps, raw_caps) == TRUE, gst_caps_can_intersect(caps, jpeg_caps) == TRUE});
+            }
+            if (caps)
+                gst_caps_unref(caps);
+            gst_structure_free(props);
+        }
+        gst_object_unref(device);
+    }
+    g_list_free(devices);
+
+    gst_caps_unref(h264_caps);
+    gst_caps_unref(raw_caps);
+    gst_caps_unref(jpeg_caps);
+    gst_object_unref(monitor);
+    return found;
+}
+
+
+/* The plugin is installed on every Raspberry Pi OS image, camera or not.
+ * rpicamsrc opens the sensor when it starts, which fails without one. */
+static bool csi_camera_present() {
+    GstElement* source = gst_element_factory_make("rpicamsrc", nullptr);
+    if (!source)
+        return false;
+    bool present = gst_element_set_state(source, GST_STATE_PAUSED) != GST_STATE_CHANGE_FAILURE;
+    gst_element_set_state(source, GST_STATE_NULL);
+    gst_object_unref(source);
+    return present;
+}
+
+
+/*
+ * Builds input_stream from what is available on this host, fastest path first:
+ * Raspberry Pi camera, V4L2 camera with on-board H.264, V4L2 camera feeding the
+ * V4L2 hardware encoder through dmabuf, then the low-latency software encoder.
+ * Every H.264 branch ends on byte-stream so payload_stream does not change, and
+ * paths that capture raw frames name their raw tee rawtee.
+ */
+static string probe_input_stream() {
+    string size = "width=" + std::to_string(video_width) + ",height=" + std::to_string(video_height)
+        + ",framerate=" + std::to_string(video_framerate) + "/1";
+    string h264_caps = "video/x-h264,profile=constrained-baseline," + size;
+    /* Exposes the raw frames to side branches such as the thumbnail rendition */
+    string raw_tee = " ! tee name=rawtee ! queue ! ";
+
+    /* Hardware paths below only produce H.264 */
+    bool hardware = video_codec == "h264";
+
+    if (hardware && video_device.empty() && has_element("rpicamsrc") && csi_camera_present()) {
+        LOG(LOG_INFO) << "Capture: rpicamsrc with on-chip encoder";
+        /* A single keyframe, then cyclic refresh only */
+        string refresh = intra_refresh ? " intra-refresh-type=cyclic keyframe-interval=0" : "";
+        return "rpicamsrc preview=false bitrate=" + std::to_string(video_bitrate * 1000) + refresh
+            + " ! " + h264_caps + " ! h264parse";
+    }
+
+    /* A camera that encodes itself wins over one that needs an encoder, and
+     * raw frames over MJPEG that has to be decoded first. Anything else, e.g.
+     * bayer sensor nodes or metadata devices, cannot feed the pipeline. */
+    bool jpegdec = has_element("jpegdec");
+    auto rank = [hardware, jpegdec](const CaptureDevice& candidate) {
+        return hardware && candidate.h264 ? 3 : candidate.raw ? 2 : jpegdec && candidate.jpeg ? 1 : 0;
+    };
+
+    vector<CaptureDevice> devices = probe_capture_devices();
+    const CaptureDevice* device = nullptr;
+    for (auto& candidate : devices) {
+        if (!video_device.empty() && candidate.path != video_device)
+            continue;
+        if (rank(candidate) && (!device || rank(candidate) > rank(*device)))
+            device = &candidate;
+    }
+
+    if (!device) {
+        LOG(LOG_WARNING) << "Capture: no usable V4L2 camera found, using test source";
+        return "videotestsrc is-live=true ! video/x-raw," + size + raw_tee + software_encoder(true);
+    }
+
+    string source = "v4l2src device=" + device->path;
+    if (hardware && device->h264) {
+        LOG(LOG_INFO) << "Capture: " << device->path << " with on-board H.264";
+        return source + " ! " + h264_caps + " ! h264parse";
+    }
+
+    string capture = device->raw ? source + " ! video/x-raw," + size
+        : source + " ! image/jpeg," + size + " ! jpegdec ! videoconvert";
+    string format = device->raw ? "raw" : "MJPEG";
+
+    if (hardware && has_element("v4l2h264enc")) {
+        /* Raw capture buffers are handed to the encoder as dmabufs, no copy */
+        LOG(LOG_INFO) << "Capture: " << device->path << " " << format << " with v4l2h264enc" << (device->raw ? " (dmabuf)" : "");
+        return (device->raw ? source + " io-mode=dmabuf ! video/x-raw," + size : capture) + raw_tee
+            + "v4l2h264enc" + (device->raw ? " output-io-mode=dmabuf-import" : "")
+            + " extra-controls=\"controls,repeat_sequence_header=1,video_bitrate=" + std::to_string(video_bitrate * 1000)
+            + (intra_refresh ? ",intra_refresh_period=" + std::to_string(video_framerate * 2) : "")
+            + "\" ! video/x-h264,level=(string)4 ! h264parse";
+    }
+
+    LOG(LOG_INFO) << "Capture: " << device->path << " " << format << " with software " << video_codec << " encoder";
+    return capture + raw_tee + "videoconvert ! " + software_encoder(true);
+}
+
+
+/* Must run while options are parsed, before gst_init() reads the registry.
+ * The cache is only written when missing, delete it after installing plugins. */
+static gboolean useRegistry(const gchar* option_name G_GNUC_UNUSED, const gchar* value, gpointer data G_GNUC_UNUSED, GError** error G_GNUC_UNUSED) {
+    g_setenv("GST_REGISTRY", value, true);
+    g_setenv("GST_REGISTRY_UPDATE", "no", true);
+    return true;
+}
+
+
+/* Must run while options are parsed, before gst_init() sets up its tracers */
+static gboolean enableTracing(const gchar* option_name G_GNUC_UNUSED, const gchar* value, gpointer data G_GNUC_UNUSED, GError** error G_GNUC_UNUSED) {
+    trace_file = string(value);
+    g_setenv("GST_TRACERS", "latency(flags=pipeline+element);proctime", true);
+    return true;
+}
+
+
 GOptionContext* createContext(int argc, char *argv[]) {
     GOptionContext* context;
     GError* error = nullptr;
@@ -499,6 +3116,50 @@ GOptionContext* createContext(int argc, char *argv[]) {
     gboolean g_use_http_auth = false;
     gchar* g_http_user = nullptr;
     gchar* g_http_password = nullptr;
+    gchar* g_log_level = nullptr;
+    gboolean g_auto_input = false;
+    gchar* g_video_device = nullptr;
+    gint g_video_width = 0;
+    gint g_video_height = 0;
+    gint g_video_framerate = 0;
+    gint g_video_bitrate = 0;
+    gchar* g_video_codec = nullptr;
+    gboolean g_low_latency_encoder = false;
+    gboolean g_intra_refresh = false;
+    gchar* g_record_dir = nullptr;
+    gchar* g_record_format = nullptr;
+    gint g_record_segment = 0;
+    gint g_record_retention = 0;
+    gint g_preroll_seconds = 0;
+    gint g_preroll_max_mb = 0;
+    gchar* g_clip_dir = nullptr;
+    gboolean g_snapshots = false;
+    gint g_snapshot_port = 0;
+    gchar* g_snapshot_address = nullptr;
+    gint g_snapshot_ttl = 0;
+    gboolean g_thumbnail = false;
+    gboolean g_motion = false;
+    gint g_motion_threshold = 0;
+    gboolean g_activity = false;
+    gdouble g_activity_threshold = 0;
+    gchar* g_audio_stream = nullptr;
+    gint g_rtx_time = 0;
+    gint g_fec_percentage = 0;
+    gint g_fec_max_percentage = 0;
+    gchar* g_relay_source = nullptr;
+    gchar** g_cameras = nullptr;
+    gint g_keepalive_interval = 0;
+    gchar* g_stun_server = nullptr;
+    gchar* g_turn_server = nullptr;
+    gboolean g_ice_host_only = false;
+    gboolean g_ice_udp_only = false;
+    gchar* g_ice_interfaces = nullptr;
+    gchar* g_ice_family = nullptr;
+    gchar* g_ice_ports = nullptr;
+    gdouble g_pacing_factor = 0;
+    gint g_rtp_mtu = 0;
+    gboolean g_drop_frames = false;
+    gboolean g_rtp_mtu_auto = false;
 
     GOptionEntry entries[] = {
       { "local-id", 'i', 0, G_OPTION_ARG_STRING, &g_local_id, "Camera identifier", "string" },
@@ -507,9 +3168,55 @@ GOptionContext* createContext(int argc, char *argv[]) {
       { "input-stream", 0, 0, G_OPTION_ARG_STRING, &g_input_stream, "Stream source and encoding", "string" },
       { "payload-stream", 0, 0, G_OPTION_ARG_STRING, &g_payload_stream, "Stream payload", "string" },
       { "ssl", 0, 0, G_OPTION_ARG_NONE, &g_use_ssl, "Enable ssl", nullptr },
+      { "keepalive", 0, 0, G_OPTION_ARG_INT, &g_keepalive_interval, "Seconds between websocket pings, 0 disables them", "int" },
       { "http-auth", 0, 0, G_OPTION_ARG_NONE, &g_use_http_auth, "Enable HTTP basic authentication", nullptr },
       { "http-user", 0, 0, G_OPTION_ARG_STRING, &g_http_user, "HTTP basic authentication user", "string" },
       { "http-password", 0, 0, G_OPTION_ARG_STRING, &g_http_password, "HTTP basic authentication password", "string" },
+      { "auto-input", 0, 0, G_OPTION_ARG_NONE, &g_auto_input, "Pick the fastest capture and encoder available instead of --input-stream", nullptr },
+      { "video-device", 0, 0, G_OPTION_ARG_STRING, &g_video_device, "V4L2 device used by --auto-input", "path" },
+      { "width", 0, 0, G_OPTION_ARG_INT, &g_video_width, "Capture width used by --auto-input", "int" },
+      { "height", 0, 0, G_OPTION_ARG_INT, &g_video_height, "Capture height used by --auto-input", "int" },
+      { "framerate", 0, 0, G_OPTION_ARG_INT, &g_video_framerate, "Capture framerate used by --auto-input", "int" },
+      { "bitrate", 0, 0, G_OPTION_ARG_INT, &g_video_bitrate, "Encoder bitrate in kbit/s used by --auto-input", "int" },
+      { "video-codec", 0, 0, G_OPTION_ARG_STRING, &g_video_codec, "Software encoder codec: h264 or vp8", "string" },
+      { "low-latency-encoder", 0, 0, G_OPTION_ARG_NONE, &g_low_latency_encoder, "Tune the software encoder for latency instead of quality", nullptr },
+      { "intra-refresh", 0, 0, G_OPTION_ARG_NONE, &g_intra_refresh, "Use the hardware encoder's rolling intra refresh instead of periodic IDR frames", nullptr },
+      { "record-dir", 0, 0, G_OPTION_ARG_STRING, &g_record_dir, "Record the encoded stream to segments in this directory", "path" },
+      { "record-format", 0, 0, G_OPTION_ARG_STRING, &g_record_format, "Recording container: mp4 or ts", "string" },
+      { "record-segment", 0, 0, G_OPTION_ARG_INT, &g_record_segment, "Recording segment duration in seconds", "int" },
+      { "record-retention", 0, 0, G_OPTION_ARG_INT, &g_record_retention, "Seconds of recording kept on disk", "int" },
+      { "preroll", 0, 0, G_OPTION_ARG_INT, &g_preroll_seconds, "Seconds of encoded video kept in RAM for SAVE_CLIP", "int" },
+      { "preroll-max-mb", 0, 0, G_OPTION_ARG_INT, &g_preroll_max_mb, "Memory cap of the pre-roll buffer in MiB", "int" },
+      { "clip-dir", 0, 0, G_OPTION_ARG_STRING, &g_clip_dir, "Directory where SAVE_CLIP writes clips", "path" },
+      { "snapshots", 0, 0, G_OPTION_ARG_NONE, &g_snapshots, "Answer SNAPSHOT commands with a JPEG of the latest frame", nullptr },
+      { "snapshot-port", 0, 0, G_OPTION_ARG_INT, &g_snapshot_port, "Also serve snapshots over HTTP on this port", "int" },
+      { "snapshot-address", 0, 0, G_OPTION_ARG_STRING, &g_snapshot_address, "Address the snapshot server listens on (default: 127.0.0.1)", "address" },
+      { "snapshot-ttl", 0, 0, G_OPTION_ARG_INT, &g_snapshot_ttl, "Milliseconds a snapshot is served from cache", "int" },
+      { "thumbnail", 0, 0, G_OPTION_ARG_NONE, &g_thumbnail, "Encode a 320x180 5 fps rendition for CALLs with mode thumbnail", nullptr },
+      { "motion", 0, 0, G_OPTION_ARG_NONE, &g_motion, "Detect motion and send MOTION events", nullptr },
+      { "motion-threshold", 0, 0, G_OPTION_ARG_INT, &g_motion_threshold, "Mean pixel difference of a region that counts as motion (0-255)", "int" },
+      { "activity", 0, 0, G_OPTION_ARG_NONE, &g_activity, "Estimate scene activity from encoded frame sizes and send ACTIVITY events", nullptr },
+      { "activity-threshold", 0, 0, G_OPTION_ARG_DOUBLE, &g_activity_threshold, "Short over long term frame size ratio that counts as activity", "float" },
+      { "audio-stream", 0, 0, G_OPTION_ARG_STRING, &g_audio_stream, "Audio source sent to peers: test, alsa, pulse or a gst-launch source", "string" },
+      { "rtx-time", 0, 0, G_OPTION_ARG_INT, &g_rtx_time, "Enable NACK/RTX with a retransmission buffer of this many milliseconds", "int" },
+      { "fec", 0, 0, G_OPTION_ARG_INT, &g_fec_percentage, "Enable ULPFEC with this minimum overhead in percent", "int" },
+      { "fec-max", 0, 0, G_OPTION_ARG_INT, &g_fec_max_percentage, "Maximum ULPFEC overhead in percent reached on lossy links", "int" },
+      { "rtp-mtu", 0, 0, G_OPTION_ARG_INT, &g_rtp_mtu, "Maximum RTP packet size in bytes", "int" },
+      { "rtp-mtu-auto", 0, 0, G_OPTION_ARG_NONE, &g_rtp_mtu_auto, "Lower the RTP packet size to the path MTU towards each viewer", nullptr },
+      { "pacing", 0, 0, G_OPTION_ARG_DOUBLE, &g_pacing_factor, "Pace each peer's video at this multiple of the bitrate, e.g. 2.5", "float" },
+      { "drop-frames", 0, 0, G_OPTION_ARG_NONE, &g_drop_frames, "Drop frames for congested viewers instead of queueing them", nullptr },
+      { "relay", 0, 0, G_OPTION_ARG_STRING, &g_relay_source, "Forward the stream of this camera to viewers instead of capturing", "camera id" },
+      { "stun-server", 0, 0, G_OPTION_ARG_STRING, &g_stun_server, "STUN server for server reflexive candidates", "stun://host:port" },
+      { "turn-server", 0, 0, G_OPTION_ARG_STRING, &g_turn_server, "TURN server for relay candidates", "turn(s)://user:password@host:port" },
+      { "ice-host-only", 0, 0, G_OPTION_ARG_NONE, &g_ice_host_only, "Only gather host candidates, ignoring --stun-server and --turn-server", nullptr },
+      { "ice-udp-only", 0, 0, G_OPTION_ARG_NONE, &g_ice_udp_only, "Do not gather ICE-TCP candidates", nullptr },
+      { "ice-interfaces", 0, 0, G_OPTION_ARG_STRING, &g_ice_interfaces, "Comma separated interfaces ICE gathers candidates on", "eth0,wlan0" },
+      { "ice-family", 0, 0, G_OPTION_ARG_STRING, &g_ice_family, "Address family of ICE candidates: ipv4 or ipv6", "string" },
+      { "ice-ports", 0, 0, G_OPTION_ARG_STRING, &g_ice_ports, "UDP port range shared by the ICE transports of all peers", "min-max" },
+      { "camera", 0, 0, G_OPTION_ARG_STRING_ARRAY, &g_cameras, "Serve an extra camera from this process, can be repeated", "id=input-stream" },
+      { "log-level", 0, 0, G_OPTION_ARG_STRING, &g_log_level, "Log level: error, warning, info or debug", "string" },
+      { "trace-file", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer) enableTracing, "Enable profiling and write a Chrome trace to this file", "path" },
+      { "registry", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer) useRegistry, "Load plugins from this registry cache instead of scanning them at startup", "path" },
       { nullptr },
     };
 
@@ -524,7 +3231,7 @@ GOptionContext* createContext(int argc, char *argv[]) {
     if(g_local_id) {
         local_id = string(g_local_id);
     } else {
-        cout << "You must provide a local id" << endl;
+        g_printerr("You must provide a local id\n");
         return nullptr;
     }
 
@@ -548,6 +3255,57 @@ GOptionContext* createContext(int argc, char *argv[]) {
         use_ssl = g_use_ssl;
     }
 
+    if(g_keepalive_interval > 0) {
+        keepalive_interval = g_keepalive_interval;
+    }
+
+    if(g_stun_server) {
+        stun_server = string(g_stun_server);
+    }
+
+    if(g_turn_server) {
+        turn_server = string(g_turn_server);
+    }
+
+    if(g_ice_host_only) {
+        ice_host_only = g_ice_host_only;
+    }
+
+    if(g_ice_udp_only) {
+        ice_udp_only = g_ice_udp_only;
+    }
+
+    if(g_ice_interfaces) {
+        gchar** names = g_strsplit(g_ice_interfaces, ",", -1);
+        for (gchar** name = names; *name; name++)
+            if (**name)
+                ice_interfaces.push_back(*name);
+        g_strfreev(names);
+    }
+
+    if(g_ice_family) {
+        const map<string, int> families = {{"ipv4", AF_INET}, {"ipv6", AF_INET6}};
+        auto family = families.find(g_ice_family);
+        if (family == families.end()) {
+            g_printerr("Unknown address family: %s\n", g_ice_family);
+            return nullptr;
+        }
+        ice_family = family->second;
+    }
+
+    if(g_ice_ports) {
+        guint min_port = 0, max_port = 0;
+        int fields = sscanf(g_ice_ports, "%u-%u", &min_port, &max_port);
+        if (fields == 1)
+            max_port = min_port;
+        if (fields < 1 || min_port == 0 || max_port < min_port || max_port > 65535) {
+            g_printerr("Invalid ICE port range: %s\n", g_ice_ports);
+            return nullptr;
+        }
+        ice_min_port = min_port;
+        ice_max_port = max_port;
+    }
+
     if(g_use_http_auth) {
         use_http_auth = g_use_http_auth;
     }
@@ -560,33 +3318,291 @@ GOptionContext* createContext(int argc, char *argv[]) {
         http_password = string(g_http_password);
     }
 
+    if(g_auto_input) {
+        auto_input = g_auto_input;
+    }
+
+    if(g_video_device) {
+        video_device = string(g_video_device);
+    }
+
+    if(g_video_width) {
+        video_width = g_video_width;
+    }
+
+    if(g_video_height) {
+        video_height = g_video_height;
+    }
+
+    if(g_video_framerate) {
+        video_framerate = g_video_framerate;
+    }
+
+    if(g_video_bitrate) {
+        video_bitrate = g_video_bitrate;
+    }
+
+    if(g_video_codec) {
+        video_codec = string(g_video_codec);
+        if (video_codec != "h264" && video_codec != "vp8") {
+            g_printerr("Unknown video codec: %s\n", g_video_codec);
+            return nullptr;
+        }
+        if (!g_payload_stream && video_codec == "vp8")
+            payload_stream = vp8_payload_stream;
+    }
+
+    if(g_low_latency_encoder) {
+        low_latency_encoder = g_low_latency_encoder;
+    }
+
+    if(g_intra_refresh) {
+        intra_refresh = g_intra_refresh;
+    }
+
+    if(g_record_dir) {
+        record_dir = string(g_record_dir);
+        if (video_codec != "h264") {
+            g_printerr("Recording is only supported with h264\n");
+            return nullptr;
+        }
+    }
+
+    if(g_record_format) {
+        record_format = string(g_record_format);
+        if (record_format != "mp4" && record_format != "ts") {
+            g_printerr("Unknown recording format: %s\n", g_record_format);
+            return nullptr;
+        }
+    }
+
+    if(g_record_segment > 0) {
+        record_segment = g_record_segment;
+    }
+
+    if(g_record_retention > 0) {
+        record_retention = g_record_retention;
+    }
+
+    if(g_preroll_seconds > 0) {
+        preroll_seconds = g_preroll_seconds;
+        if (video_codec != "h264") {
+            g_printerr("Pre-roll clips are only supported with h264\n");
+            return nullptr;
+        }
+    }
+
+    if(g_preroll_max_mb > 0) {
+        preroll_max_mb = g_preroll_max_mb;
+    }
+
+    if(g_clip_dir) {
+        clip_dir = string(g_clip_dir);
+    }
+
+    if(g_snapshots) {
+        snapshots = g_snapshots;
+    }
+
+    if(g_snapshot_port) {
+        snapshot_port = g_snapshot_port;
+        snapshots = true;
+    }
+
+    if(g_snapshot_address) {
+        snapshot_address = string(g_snapshot_address);
+    }
+
+    if(g_snapshot_ttl > 0) {
+        snapshot_ttl = g_snapshot_ttl;
+    }
+
+    if(g_thumbnail) {
+        thumbnail = g_thumbnail;
+    }
+
+    if(g_motion) {
+        motion = g_motion;
+    }
+
+    if(g_motion_threshold > 0) {
+        motion_threshold = g_motion_threshold;
+    }
+
+    if(g_activity) {
+        activity = g_activity;
+    }
+
+    if(g_activity_threshold > 0) {
+        activity_threshold = g_activity_threshold;
+    }
+
+    if(g_audio_stream) {
+        const map<string, string> audio_sources = {
+            {"test", "audiotestsrc is-live=true"},
+            {"alsa", "alsasrc"},
+            {"pulse", "pulsesrc"},
+        };
+        auto source = audio_sources.find(g_audio_stream);
+        audio_stream = source != audio_sources.end() ? source->second : string(g_audio_stream);
+    }
+
+    if(g_rtx_time > 0) {
+        rtx_time = g_rtx_time;
+    }
+
+    if(g_fec_percentage > 0) {
+        fec_percentage = g_fec_percentage;
+    }
+
+    if(g_fec_max_percentage > 0) {
+        fec_max_percentage = std::max(g_fec_max_percentage, fec_percentage);
+    }
+
+    if(g_drop_frames) {
+        drop_frames = g_drop_frames;
+    }
+
+    if(g_rtp_mtu > 0) {
+        rtp_mtu = std::max(g_rtp_mtu, 500);
+    }
+
+    if(g_rtp_mtu_auto) {
+        rtp_mtu_auto = g_rtp_mtu_auto;
+    }
+
+    if(g_pacing_factor > 0) {
+        pacing_factor = std::max(g_pacing_factor, 1.0);
+    }
+
+    /* These wait for IDR frames, which intra refresh only sends on request */
+    if (intra_refresh && (!record_dir.empty() || preroll_seconds || snapshots)) {
+        g_printerr("--intra-refresh is not available with --record-dir, --preroll or --snapshots\n");
+        return nullptr;
+    }
+
+    if(g_relay_source) {
+        relay_source = string(g_relay_source);
+        if (auto_input || intra_refresh || !record_dir.empty() || preroll_seconds || snapshots || thumbnail || motion
+                || activity || !audio_stream.empty()) {
+            g_printerr("--relay only forwards packets, capture and analysis options are not available\n");
+            return nullptr;
+        }
+    }
+
+    if (g_cameras && !relay_source.empty()) {
+        g_printerr("--camera is not available with --relay\n");
+        return nullptr;
+    }
+    for (gchar** camera = g_cameras; camera && *camera; camera++) {
+        string spec(*camera);
+        size_t separator = spec.find('=');
+        if (separator == string::npos || separator == 0 || spec.substr(0, separator) == local_id) {
+            g_printerr("--camera expects a distinct id=input-stream: %s\n", *camera);
+            return nullptr;
+        }
+        extra_cameras[spec.substr(0, separator)] = spec.substr(separator + 1);
+    }
+    g_strfreev(g_cameras);
+
+    /* Default test source, with the requested software encoder settings */
+    if(!g_input_stream && (low_latency_encoder || video_codec != "h264")) {
+        input_stream = "videotestsrc is-live=true ! tee name=rawtee ! queue ! " + software_encoder(low_latency_encoder);
+    }
+
+    if(g_log_level) {
+        auto name = std::find(std::begin(log_level_names), std::end(log_level_names), string(g_log_level));
+        if (name == std::end(log_level_names)) {
+            g_printerr("Unknown log level: %s\n", g_log_level);
+            return nullptr;
+        }
+        log_level = static_cast<LogLevel>(name - std::begin(log_level_names));
+    }
+
     return context;
 }
 
 
 int main(int argc, char *argv[]) {
+    startup_begin = startup_last = g_get_monotonic_time();
     GOptionContext* context = createContext(argc, argv);
     if(!context){
         return -1;
     }
 
+    log_start();
+    startup_mark("gst_init");
+
+    if (!trace_file.empty())
+        start_tracing();
+
+    if (auto_input) {
+        input_stream = probe_input_stream();
+        startup_mark("capture probe");
+    }
+
+    ice_addresses = ice_local_addresses();
+    if (!ice_addresses.empty()) {
+        std::ostringstream addresses;
+        for (auto& address : ice_addresses)
+            addresses << " " << address;
+        LOG(LOG_INFO) << "ICE candidates gathered on" << addresses.str();
+    } else if (!ice_interfaces.empty() || ice_family != AF_UNSPEC) {
+        LOG(LOG_ERROR) << "No address matches --ice-interfaces and --ice-family";
+        log_stop();
+        return -1;
+    }
+
     loop = g_main_loop_new(nullptr, false);
 
+    /* Ctrl-C and systemctl stop leave through the main loop, so the pipelines
+     * are stopped and the trace is written */
+    g_unix_signal_add(SIGINT, onStopSignal, nullptr);
+    g_unix_signal_add(SIGTERM, onStopSignal, nullptr);
+
+    if (fec_percentage || drop_frames)
+        g_timeout_add_seconds(2, pollPeerStats, nullptr);
+
     commandsMapping["JOINED_CAMERA"] = doRegistration;
     commandsMapping["UPDATE_CAMERAS"] = notMapped;
     commandsMapping["CALL"] = callPeer;
+    commandsMapping["HANG_UP"] = hangUp;
     commandsMapping["SDP_ANSWER"] = onSDPAnswer;
     commandsMapping["ICE_ANSWER"] = onICEAnswer;
+    commandsMapping["SAVE_CLIP"] = saveClip;
+    commandsMapping["SNAPSHOT"] = sendSnapshot;
+    commandsMapping["GET_STATS"] = sendStats;
+    if (!relay_source.empty()) {
+        commandsMapping["SDP_OFFER"] = onUpstreamOffer;
+        commandsMapping["ICE_CANDIDATE"] = onUpstreamICECandidate;
+    }
+
+    if (!check_plugins()) {
+        log_stop();
+        return -1;
+    }
+    startup_mark("plugin check");
 
-    if (!check_plugins())
+    if (snapshot_port && !start_snapshot_server()) {
+        log_stop();
         return -1;
+    }
+    std::thread certificate(generate_certificate);
     connect();
+    std::thread pipelines(start_pipelines);
 
     g_main_loop_run(loop);
+    certificate.join();
+    pipelines.join();
+
+    for (auto& camera : camera_pipelines)
+        gst_element_set_state(camera.second, GST_STATE_NULL);
+    LOG(LOG_INFO) << "Pipeline stopped";
 
-    gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_NULL);
-    g_print("Pipeline stopped\n");
+    write_trace_file();
 
-    gst_object_unref(pipeline);
-    return 0;
+    for (auto& camera : camera_pipelines)
+        gst_object_unref(camera.second);
+    log_stop();
+    return pipelines_failed ? -1 : 0;
 }
@@ -0,0 +1,9 @@
+#!/usr/bin/bash
+# Emulates a lossy link on the camera's outgoing traffic to check --rtx-time
+# and --fec, e.g. ./simulate-loss.sh wlan0 5% 30ms. Needs root (tc netem).
+# ./simulate-loss.sh wlan0 off removes it.
+if [ "$2" == "off" ]; then
+    tc qdisc del dev $1 root netem
+else
+    tc qdisc replace dev $1 root netem loss ${2:-5%} delay ${3:-20ms} 10ms
+fi